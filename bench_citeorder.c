@@ -0,0 +1,407 @@
+// bench_citeorder: end-to-end throughput benchmark for citeorder
+//
+// Generates deterministic Markdown documents of increasing size and times the
+// citeorder binary on each, reporting throughput (MB/s, citations/s) and peak
+// RSS so that regressions and non-linear scaling show up. Build it next to
+// citeorder and run it from the repository root:
+//
+//   gcc -Wall -Wextra -O2 -o bench_citeorder bench_citeorder.c -lm
+//   ./bench_citeorder                      (sizes 1K..1G)
+//   ./bench_citeorder --max 64M --flags -s
+//   ./bench_citeorder --generate doc.md --size 10M --labels alnum
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define CITEORDER_BIN "citeorder.exe"
+#else
+#define CITEORDER_BIN "./citeorder"
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#endif
+
+typedef struct {
+    long long size;     // target document size in bytes, used when lines is 0
+    long long lines;    // body lines
+    long long footnotes;// distinct labels, 0 to derive from density
+    int density;        // footnotes per 100 body lines
+    int stack;          // maximum stack depth, e.g. [^1][^2][^3] is 3
+    int alnum;          // '6b'-style labels instead of numeric ones
+    int fenced;         // percent of paragraphs that are fenced code blocks
+    int multiline;      // percent of quotes spanning two lines
+    int reuse;          // percent of citations of an already cited label
+    uint64_t seed;
+} Spec;
+
+// What was generated, for the throughput figures
+typedef struct {
+    long long bytes;
+    long long lines;
+    long long footnotes;
+    long long citations;
+} DocStats;
+
+static const char *words[] = {
+    "the", "footnote", "order", "of", "a", "document", "is", "kept", "in", "sync",
+    "with", "where", "each", "source", "was", "first", "cited", "so", "readers", "can",
+    "follow", "along", "without", "jumping", "back", "and", "forth", "between", "notes", "text"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+#define AVG_LINE 48     // rough bytes per body line, to turn a size into a line count
+
+// xorshift64*, so that a seed always gives the same document on every platform
+static uint64_t nextRandom(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static long long randomBelow(uint64_t *state, long long n) {
+    return n > 0 ? (long long)(nextRandom(state) % (uint64_t)n) : 0;
+}
+
+static void writeLabel(FILE *f, const Spec *spec, long long id, DocStats *st) {
+    if (spec->alnum) {
+        st->bytes += fprintf(f, "%lld%c", id / 26 + 1, 'a' + (int)(id % 26));
+    } else {
+        st->bytes += fprintf(f, "%lld", id + 1);
+    }
+}
+
+static void writeWords(FILE *f, uint64_t *rng, int n, DocStats *st) {
+    for (int i = 0; i < n; i++) {
+        const char *w = words[randomBelow(rng, NWORDS)];
+        st->bytes += fprintf(f, i ? " %s" : "%s", w);
+    }
+}
+
+static void writeCite(FILE *f, const Spec *spec, long long id, DocStats *st) {
+    st->bytes += fprintf(f, "[^");
+    writeLabel(f, spec, id, st);
+    st->bytes += fprintf(f, "]");
+    st->citations++;
+}
+
+// Write a document: paragraphs of plain and quoted lines, citing every label
+// once in order of a shuffled numbering (so everything gets renumbered), some
+// citations reusing earlier labels, some paragraphs fenced off with decoy
+// citations inside, and all full entries at the end in shuffled order.
+static int generateDocument(FILE *f, const Spec *spec, DocStats *st) {
+    uint64_t rng = spec->seed ? spec->seed : 1;
+    memset(st, 0, sizeof(*st));
+
+    long long lines = spec->lines;
+    if (lines <= 0) lines = spec->size / AVG_LINE;
+    if (lines < 1) lines = 1;
+    long long nfoot = spec->footnotes;
+    if (nfoot <= 0) nfoot = lines * spec->density / 100;
+    if (nfoot < 1) nfoot = 1;
+    int depth = spec->stack < 1 ? 1 : spec->stack;
+
+    // labels[i] is the label of the i-th footnote cited
+    long long *labels = malloc((size_t)nfoot * sizeof(*labels));
+    if (!labels) return -1;
+    for (long long i = 0; i < nfoot; i++) labels[i] = i;
+    for (long long i = nfoot - 1; i > 0; i--) {
+        long long j = randomBelow(&rng, i + 1);
+        long long t = labels[i]; labels[i] = labels[j]; labels[j] = t;
+    }
+
+    long long cited = 0;
+    long long line = 0;
+    while (line < lines) {
+        int para = 1 + (int)randomBelow(&rng, 6);
+        int fence = randomBelow(&rng, 100) < spec->fenced;
+        if (fence) st->bytes += fprintf(f, "```md\n");
+        for (int p = 0; p < para && line < lines; p++, line++) {
+            writeWords(f, &rng, 3 + (int)randomBelow(&rng, 5), st);
+            if (fence) {
+                // never counted: citeorder must skip everything in the fence
+                st->bytes += fprintf(f, " \"decoy\"[^");
+                writeLabel(f, spec, randomBelow(&rng, nfoot), st);
+                st->bytes += fprintf(f, "]\n");
+                continue;
+            }
+
+            // cite new labels on enough lines to use them all by the end
+            long long left = nfoot - cited;
+            long long linesLeft = lines - line;
+            int k = 0;
+            if (left > 0 && randomBelow(&rng, linesLeft) < left) {
+                k = 1 + (int)randomBelow(&rng, depth);
+                long long need = (left + linesLeft - 1) / linesLeft;
+                if (k < need) k = (int)need;
+                if (k > left) k = (int)left;
+            }
+            int reuse = k == 0 && cited > 0 && randomBelow(&rng, 100) < spec->reuse;
+            if (k == 0 && !reuse) {
+                st->bytes += fprintf(f, ".\n");
+                continue;
+            }
+
+            if (randomBelow(&rng, 100) < spec->multiline) {
+                st->bytes += fprintf(f, " \"");
+                writeWords(f, &rng, 2 + (int)randomBelow(&rng, 4), st);
+                st->bytes += fprintf(f, "\n");
+                line++;
+                writeWords(f, &rng, 2 + (int)randomBelow(&rng, 4), st);
+                st->bytes += fprintf(f, "\",");
+            } else {
+                st->bytes += fprintf(f, " \"");
+                writeWords(f, &rng, 2 + (int)randomBelow(&rng, 4), st);
+                st->bytes += fprintf(f, "\"");
+            }
+            if (reuse) {
+                writeCite(f, spec, labels[randomBelow(&rng, cited)], st);
+            }
+            for (int s = 0; s < k; s++) {
+                writeCite(f, spec, labels[cited++], st);
+            }
+            st->bytes += fprintf(f, " ");
+            writeWords(f, &rng, 1 + (int)randomBelow(&rng, 4), st);
+            st->bytes += fprintf(f, ".\n");
+        }
+        if (fence) st->bytes += fprintf(f, "```\n");
+        st->bytes += fprintf(f, "\n");
+    }
+
+    // full entries, in label order, which is the shuffled order of citation
+    for (long long i = 0; i < nfoot; i++) {
+        st->bytes += fprintf(f, "[^");
+        writeLabel(f, spec, i, st);
+        st->bytes += fprintf(f, "]: ");
+        writeWords(f, &rng, 3 + (int)randomBelow(&rng, 6), st);
+        st->bytes += fprintf(f, ".\n");
+    }
+    st->lines = line;
+    st->footnotes = nfoot;
+    free(labels);
+    return ferror(f) ? -1 : 0;
+}
+
+static double now(void) {
+#ifdef _WIN32
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run citeorder on path once, discarding its messages. Returns its exit status,
+// or -1 if it could not be run; *rssKB is its peak resident set, 0 if unknown.
+static int runCiteorder(const char *flags, const char *path, double *seconds, long *rssKB) {
+    *rssKB = 0;
+#ifdef _WIN32
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "%s %s \"%s\" >NUL 2>&1", CITEORDER_BIN, flags, path);
+    double t0 = now();
+    int rc = system(cmd);
+    *seconds = now() - t0;
+    return rc;
+#else
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "exec %s %s \"%s\" >/dev/null 2>&1", CITEORDER_BIN, flags, path);
+    double t0 = now();
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) return -1;
+    *seconds = now() - t0;
+#ifdef __APPLE__
+    *rssKB = ru.ru_maxrss / 1024;   // bytes on macOS
+#else
+    *rssKB = ru.ru_maxrss;
+#endif
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+// "64K", "16M", "1G" or plain bytes
+static long long parseSize(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0) return -1;
+    switch (*end) {
+        case 'k': case 'K': v *= 1024; end++; break;
+        case 'm': case 'M': v *= 1024 * 1024; end++; break;
+        case 'g': case 'G': v *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    return *end ? -1 : (long long)v;
+}
+
+static void formatSize(char *buf, size_t n, long long bytes) {
+    if (bytes >= 1024LL * 1024 * 1024) snprintf(buf, n, "%.1fG", bytes / (1024.0 * 1024 * 1024));
+    else if (bytes >= 1024 * 1024)     snprintf(buf, n, "%.1fM", bytes / (1024.0 * 1024));
+    else if (bytes >= 1024)            snprintf(buf, n, "%.1fK", bytes / 1024.0);
+    else                               snprintf(buf, n, "%lldB", bytes);
+}
+
+static void printUsage(void) {
+    printf("Usage: bench_citeorder [options]\n"
+           "       bench_citeorder --generate FILE [document options]\n\n"
+           "Benchmark options:\n"
+           "  --min SIZE        Smallest document (default 1K)\n"
+           "  --max SIZE        Largest document, sizes step by x4 (default 1G)\n"
+           "  --runs N          Runs per size, the fastest is reported (default 3)\n"
+           "  --flags \"...\"     Extra citeorder flags, e.g. \"-s\"\n"
+           "  --keep            Keep the generated documents\n\n"
+           "Document options:\n"
+           "  --size SIZE       Target size when --lines is not given\n"
+           "  --lines N         Body lines\n"
+           "  --footnotes N     Distinct footnotes (default from --density)\n"
+           "  --density N       Footnotes per 100 lines (default 25)\n"
+           "  --stack N         Maximum stack depth (default 3)\n"
+           "  --labels numeric|alnum   Label style, 12 or 6b (default numeric)\n"
+           "  --fenced PCT      Paragraphs in fenced code blocks (default 5)\n"
+           "  --multiline PCT   Quotes spanning two lines (default 10)\n"
+           "  --reuse PCT       Citations of an already cited label (default 10)\n"
+           "  --seed N          Random seed (default 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    Spec spec = { .size = 1024, .density = 25, .stack = 3, .fenced = 5,
+                  .multiline = 10, .reuse = 10, .seed = 1 };
+    long long minSize = 1024, maxSize = 1024LL * 1024 * 1024;
+    int runs = 3, keep = 0;
+    const char *flags = "";
+    const char *generate = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0) {
+            printUsage();
+            return 0;
+        } else if (strcmp(a, "--keep") == 0) {
+            keep = 1;
+            continue;
+        }
+        if (!v) {
+            fprintf(stderr, "ERROR: unknown option or missing value '%s'\n", a);
+            return 1;
+        }
+        i++;
+        if      (strcmp(a, "--min") == 0)       minSize = parseSize(v);
+        else if (strcmp(a, "--max") == 0)       maxSize = parseSize(v);
+        else if (strcmp(a, "--size") == 0)      spec.size = parseSize(v);
+        else if (strcmp(a, "--runs") == 0)      runs = atoi(v);
+        else if (strcmp(a, "--flags") == 0)     flags = v;
+        else if (strcmp(a, "--generate") == 0)  generate = v;
+        else if (strcmp(a, "--lines") == 0)     spec.lines = atoll(v);
+        else if (strcmp(a, "--footnotes") == 0) spec.footnotes = atoll(v);
+        else if (strcmp(a, "--density") == 0)   spec.density = atoi(v);
+        else if (strcmp(a, "--stack") == 0)     spec.stack = atoi(v);
+        else if (strcmp(a, "--fenced") == 0)    spec.fenced = atoi(v);
+        else if (strcmp(a, "--multiline") == 0) spec.multiline = atoi(v);
+        else if (strcmp(a, "--reuse") == 0)     spec.reuse = atoi(v);
+        else if (strcmp(a, "--seed") == 0)      spec.seed = strtoull(v, NULL, 10);
+        else if (strcmp(a, "--labels") == 0) {
+            if (strcmp(v, "alnum") == 0) spec.alnum = 1;
+            else if (strcmp(v, "numeric") == 0) spec.alnum = 0;
+            else { fprintf(stderr, "ERROR: unknown label style '%s'\n", v); return 1; }
+        } else {
+            fprintf(stderr, "ERROR: unknown option '%s'\n", a);
+            return 1;
+        }
+    }
+    if (minSize <= 0 || maxSize < minSize || spec.size <= 0 || runs < 1) {
+        fprintf(stderr, "ERROR: invalid size or run count\n");
+        return 1;
+    }
+
+    DocStats st;
+    if (generate) {
+        FILE *f = fopen(generate, "wb");
+        if (!f) { perror(generate); return 1; }
+        int rc = generateDocument(f, &spec, &st);
+        if (fclose(f) != 0) rc = -1;
+        if (rc != 0) { fprintf(stderr, "ERROR: could not write %s\n", generate); return 1; }
+        printf("%s: %lld bytes, %lld lines, %lld footnotes, %lld citations\n",
+               generate, st.bytes, st.lines, st.footnotes, st.citations);
+        return 0;
+    }
+
+    printf("citeorder benchmark: flags \"%s\", labels %s, stack %d, fenced %d%%, "
+           "multiline %d%%, reuse %d%%, seed %llu, best of %d\n\n",
+           flags, spec.alnum ? "alnum" : "numeric", spec.stack, spec.fenced,
+           spec.multiline, spec.reuse, (unsigned long long)spec.seed, runs);
+    printf("%8s %10s %10s %10s %9s %12s %9s %8s\n",
+           "size", "lines", "citations", "time (ms)", "MB/s", "cites/s", "RSS (MB)", "ns/byte");
+
+    // first and last timing long enough to trust, for the scaling exponent
+    double firstT = 0, lastT = 0, firstB = 0, lastB = 0;
+    int failed = 0;
+    for (long long size = minSize; size <= maxSize; size *= 4) {
+        char path[64], fixed[64];
+        snprintf(path, sizeof(path), "bench-%lld.md", size);
+        snprintf(fixed, sizeof(fixed), "bench-%lld-fixed.md", size);
+
+        spec.size = size;
+        spec.lines = 0;
+        FILE *f = fopen(path, "wb");
+        if (!f) { perror(path); return 1; }
+        int rc = generateDocument(f, &spec, &st);
+        if (fclose(f) != 0 || rc != 0) {
+            fprintf(stderr, "ERROR: could not write %s\n", path);
+            remove(path);
+            return 1;
+        }
+
+        double best = 0;
+        long rss = 0;
+        for (int r = 0; r < runs; r++) {
+            double t;
+            long kb;
+            rc = runCiteorder(flags, path, &t, &kb);
+            if (rc != 0) break;
+            if (r == 0 || t < best) best = t;
+            if (kb > rss) rss = kb;
+        }
+        char sz[24];
+        formatSize(sz, sizeof(sz), st.bytes);
+        if (rc != 0) {
+            printf("%8s  citeorder exited with status %d (run with --keep to inspect %s)\n", sz, rc, path);
+            failed = 1;
+        } else {
+            double mb = st.bytes / (1024.0 * 1024);
+            printf("%8s %10lld %10lld %10.2f %9.1f %12.0f %9.1f %8.2f\n",
+                   sz, st.lines, st.citations, best * 1e3, mb / best,
+                   st.citations / best, rss / 1024.0, best * 1e9 / st.bytes);
+            if (best >= 0.01) {
+                if (firstT == 0) { firstT = best; firstB = st.bytes; }
+                lastT = best;
+                lastB = st.bytes;
+            }
+        }
+        fflush(stdout);
+        if (!keep) {
+            remove(path);
+            remove(fixed);
+        }
+        if (rc != 0) break;
+    }
+
+    if (lastB > firstB) {
+        // time ~ size^k: 1.0 is linear, noticeably above it is not
+        printf("\nscaling exponent %.2f (1.00 is linear)\n",
+               log(lastT / firstT) / log(lastB / firstB));
+    }
+    return failed;
+}
@@ -0,0 +1,210 @@
+// bench_scan: microbenchmark of the byte scanners behind lexing and quote checks
+//
+// libciteorder.c finds "[^", "``", "]:", '"' and ']' with SSE2 or AVX2 where
+// the CPU has them, and with plain loops elsewhere. This checks that every
+// scanner available here finds the same bytes as the scalar one, then times
+// each on the same generated prose, alone and inside the lexer and the quote
+// scan. It includes libciteorder.c to reach its internals:
+//
+//   gcc -Wall -Wextra -O2 -o bench_scan bench_scan.c
+//   ./bench_scan --size 64M
+#include "libciteorder.c"
+#include <stdint.h>
+#include <time.h>
+
+typedef struct {
+    const char *name;
+    Scanner scanner;
+    int available;
+} Variant;
+
+static const char *words[] = {
+    "the", "footnote", "order", "of", "a", "document", "is", "kept", "in", "sync",
+    "with", "where", "each", "source", "was", "first", "cited", "so", "readers", "can"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+// xorshift64*, as in bench_citeorder.c
+static uint64_t nextRandom(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Prose lines of 30-90 bytes; one in four quotes something and cites it, and
+// a few hold inline code
+static char *generateProse(size_t size, uint64_t seed, size_t *len) {
+    char *buf = malloc(size + 128);
+    if (!buf) return NULL;
+    size_t n = 0;
+    int cite = 1;
+    while (n < size) {
+        size_t lineEnd = n + 30 + nextRandom(&seed) % 60;
+        uint64_t kind = nextRandom(&seed) % 16;
+        while (n < lineEnd && n < size) {
+            const char *w = words[nextRandom(&seed) % NWORDS];
+            size_t wl = strlen(w);
+            memcpy(buf + n, w, wl);
+            n += wl;
+            buf[n++] = ' ';
+        }
+        if (kind < 4) n += (size_t)sprintf(buf + n, "\"quoted\"[^%d].", cite++);
+        else if (kind == 4) n += (size_t)sprintf(buf + n, "``code``");
+        buf[n++] = '\n';
+    }
+    *len = n;
+    return buf;
+}
+
+// Every scanner must agree with the scalar one on every range of short random
+// strings dense in the bytes they look for
+static int verify(const Variant *variants, int count) {
+    static const char alphabet[] = "[]^`\":a \n";
+    uint64_t seed = 42;
+    char buf[160];
+    for (int trial = 0; trial < 200000; trial++) {
+        size_t len = (size_t)(nextRandom(&seed) % sizeof(buf));
+        for (size_t k = 0; k < len; k++) buf[k] = alphabet[nextRandom(&seed) % (sizeof(alphabet) - 1)];
+        size_t from = len ? (size_t)(nextRandom(&seed) % (len + 1)) : 0;
+        const char *s = buf + from, *end = buf + len;
+        const Scanner *ref = &variants[0].scanner;
+        for (int v = 1; v < count; v++) {
+            const Scanner *sc = &variants[v].scanner;
+            if (!variants[v].available) continue;
+            if (sc->findMark(s, end) != ref->findMark(s, end) ||
+                sc->findMarkBack(s, end) != ref->findMarkBack(s, end) ||
+                sc->findToken(s, end) != ref->findToken(s, end)) {
+                fprintf(stderr, "ERROR: %s differs from scalar on \"%.*s\"\n", variants[v].name, (int)(end - s), s);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+enum { OP_MARK, OP_MARK_BACK, OP_TOKEN, OP_LEX, OP_QUOTES, NOPS };
+static const char *opNames[NOPS] = { "mark", "mark back", "token", "lex", "quotes" };
+
+// One pass of op over every line; returns what it found, so that it is not optimized away
+static long runOp(int op, const LineIndex *idx, Arena *arena) {
+    long found = 0;
+    if (op == OP_LEX) {
+        arenaReset(arena);
+        TokenStream ts = { NULL, 0, 0, arena };
+        if (lexDocument(idx->lines, idx->count, &ts) != 0) return -1;
+        return ts.count;
+    }
+    for (int i = 0; i < idx->count; i++) {
+        const char *s = idx->lines[i].text, *end = s + idx->lines[i].len, *p;
+        switch (op) {
+            case OP_MARK:
+                for (p = s; (p = scan.findMark(p, end)) != NULL; p++) found++;
+                break;
+            case OP_MARK_BACK:
+                while ((p = scan.findMarkBack(s, end)) != NULL) { found++; end = p; }
+                break;
+            case OP_TOKEN:
+                for (p = s; (p = scan.findToken(p, end)) != NULL; p += 2) found++;
+                break;
+            case OP_QUOTES:
+                // what seeking past a line costs when it holds no mark
+                found += backScanForQuote(s, 0, idx->lines[i].len);
+                break;
+        }
+    }
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = 16 * 1024 * 1024;
+    int runs = 5;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            char *end;
+            double v = strtod(argv[++i], &end);
+            if (*end == 'K' || *end == 'k') v *= 1024;
+            if (*end == 'M' || *end == 'm') v *= 1024 * 1024;
+            size = (size_t)v;
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            printf("Usage: bench_scan [--size SIZE] [--runs N]\n");
+            return strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+    if (size == 0 || runs < 1) {
+        fprintf(stderr, "ERROR: invalid --size or --runs\n");
+        return 1;
+    }
+
+    Variant variants[] = {
+        { "scalar", { findMarkScalar, findMarkBackScalar, findTokenScalar }, 1 },
+#ifdef HAVE_SIMD
+        { "sse2", { findMarkSSE2, findMarkBackSSE2, findTokenSSE2 }, 1 },
+        { "avx2", { findMarkAVX2, findMarkBackAVX2, findTokenAVX2 }, __builtin_cpu_supports("avx2") },
+#endif
+    };
+    int nvariants = (int)(sizeof(variants) / sizeof(variants[0]));
+    if (verify(variants, nvariants) != 0) return 1;
+
+    size_t len;
+    char *doc = generateProse(size, 1, &len);
+    Arena *arena = calloc(1, sizeof(Arena));
+    Arena *lexArena = calloc(1, sizeof(Arena));
+    LineIndex idx = { NULL, 0, 0 };
+    if (!doc || !arena || !lexArena || indexLines(arena, &idx, doc, len) != 0) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return 1;
+    }
+    printf("%.1f MB of prose, %d lines; MB/s, fastest of %d runs\n\n", len / 1e6, idx.count, runs);
+    printf("%-10s", "scanner");
+    for (int op = 0; op < NOPS; op++) printf("%12s", opNames[op]);
+    printf("\n");
+
+    double scalar[NOPS] = { 0 };
+    long expected[NOPS] = { 0 };
+    for (int v = 0; v < nvariants; v++) {
+        if (!variants[v].available) {
+            printf("%-10s%12s\n", variants[v].name, "(no CPU support)");
+            continue;
+        }
+#ifdef HAVE_SIMD
+        scan = variants[v].scanner;
+#endif
+        double rate[NOPS];
+        for (int op = 0; op < NOPS; op++) {
+            double best = 1e30;
+            for (int r = 0; r < runs; r++) {
+                double t0 = now();
+                long found = runOp(op, &idx, lexArena);
+                double t = now() - t0;
+                if (t < best) best = t;
+                if (v == 0) expected[op] = found;
+                else if (found != expected[op]) {
+                    fprintf(stderr, "ERROR: %s found %ld for %s, scalar %ld\n", variants[v].name, found, opNames[op], expected[op]);
+                    return 1;
+                }
+            }
+            rate[op] = len / 1e6 / (best > 0 ? best : 1e-9);
+            if (v == 0) scalar[op] = rate[op];
+        }
+        printf("%-10s", variants[v].name);
+        for (int op = 0; op < NOPS; op++) printf("%12.0f", rate[op]);
+        printf("\n");
+        if (v > 0) {
+            printf("%-10s", "  speedup");
+            for (int op = 0; op < NOPS; op++) printf("%11.2fx", rate[op] / scalar[op]);
+            printf("\n");
+        }
+    }
+
+    arenaFree(arena);
+    arenaFree(lexArena);
+    free(arena);
+    free(lexArena);
+    free(doc);
+    return 0;
+}
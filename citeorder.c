@@ -1,878 +1,2050 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <ctype.h>
+#include <stdint.h>
 #include <string.h>
-#include <limits.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "citeorder.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/locking.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#endif
+
+#define CITEORDER_VERSION "1.2.1"
+#define MAX_PATH_LEN 4096 // longest name built from an input's: its -fixed.md, temporary file or directory
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define HAVE_INOTIFY
+#endif
 
-#define MAX_LINES 5000
-#define MAX_ENTRIES 200
-#define MAX_LINE_LEN 1024
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#define HAVE_THREADS
+#endif
+
+// The whole input file, mmap'd (or read once) into a single buffer
+typedef struct {
+    char *data;
+    size_t size;
+    int mapped;
+} Source;
+
+// Growable text buffer for messages collected while processing a file
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} TextBuf;
+
+// --cache: what processing a file with some options came to, so that the next
+// run can report the same without parsing it again
+typedef struct {
+    char *path;
+    uint64_t hash;          // of the file's contents
+    uint64_t size;
+    unsigned flags;         // the CACHE_* options it was processed with
+    int status;             // citeorder_status
+    int changed;
+    int line;
+    uint64_t outHash;       // of 'input-fixed.md', if it was written
+    char *message;          // the error, or NULL
+    char *hint;
+} CacheEntry;
 
 typedef struct {
-    char *label;
-    int newNum;
-    int lineIdx;
-    const char *text;
-} FullEntry;
+    CacheEntry *entries;    // sorted by path, then options
+    int count, cap;
+} Cache;
 
 typedef struct {
-    char *label;
-    int newNum;
-    int lineIdx;
-    char *pos;       // pointer to start of citation in line '['
-    FullEntry *ref;
-} InText;
-
-/* Define my own strdup and strndup functions */
-#ifndef HAVE_STRDUP
-static char *my_strdup(const char *s) {
-    size_t len = strlen(s) + 1;
-    char *copy = malloc(len);
-    if (copy) memcpy(copy, s, len);
-    return copy; // caller will have to free
-}
-#define strdup my_strdup
+    citeorder_opts process;
+    int batch;       // several files in one run, so name the file in messages
+    int stream;      // bounded-memory streaming mode
+    int watch;       // keep reprocessing the file whenever it is saved
+    int inPlace;     // replace the input file instead of writing '-fixed.md'
+    int serve;       // --serve: answer requests about documents kept open in memory
+    int statsJson;   // --stats=json: print the stats as one JSON object per file
+    const Cache *cache; // --cache: the outcomes of earlier runs, or NULL
+    FILE *docOut;    // where the document read from '-' is written
+} Options;
+
+// --stats: what the command line adds to the library's stats of a file
+typedef struct {
+    double readTime;     // seconds loading the file (streaming reads during the passes)
+    double writeTime;    // seconds writing the result and reporting it
+    size_t bytesWritten; // the document or diff written, 0 if none
+} IoStats;
+
+// One input file of a batch, with the messages it produced and its exit status
+typedef struct {
+    char *filename;
+    TextBuf out;
+    TextBuf err;
+    int status;
+    CacheEntry cached;  // --cache: the outcome to remember, if path is set
+} Job;
+
+typedef struct {
+    Job *jobs;
+    int count;
+    int cap;
+} JobList;
+
+#ifdef HAVE_THREADS
+// Per-worker range of job indices still to run, [lo, hi)
+typedef struct {
+    pthread_mutex_t lock;
+    int lo, hi;
+} WorkQueue;
+
+typedef struct {
+    Job *jobs;
+    const Options *opts;
+    WorkQueue *queues;
+    int nworkers;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int id;
+} Worker;
 #endif
 
-#ifndef HAVE_STRNDUP
-static char *my_strndup(const char *s, size_t n) {
-    char *copy = malloc(n);
-    if (copy) {
-        memcpy(copy, s, n);
-        copy[n] = '\0';
+// read the whole file into one buffer, using mmap where available
+static int readSource(const char *filename, Source *src) {
+#ifdef HAVE_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        src->size = (size_t)st.st_size;
+        if (src->size == 0) {
+            close(fd);
+            return 0;
+        }
+        void *map = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);
+#ifdef MADV_SEQUENTIAL
+            madvise(map, src->size, MADV_SEQUENTIAL);
+#endif
+            src->data = map;
+            src->mapped = 1;
+            return 0;
+        }
     }
-    return copy; // caller will have to free
+    close(fd);
+#endif
+    // fallback: read the file once in large chunks
+    FILE *f = fopen(filename, "rb");
+    if (!f) return -1;
+    size_t cap = 1 << 16;
+    src->size = 0;
+    src->data = malloc(cap);
+    size_t n;
+    while (src->data && (n = fread(src->data + src->size, 1, cap - src->size, f)) > 0) {
+        src->size += n;
+        if (src->size == cap) {
+            cap *= 2;
+            char *grown = realloc(src->data, cap);
+            if (!grown) { free(src->data); src->data = NULL; }
+            src->data = grown;
+        }
+    }
+    fclose(f);
+    return src->data ? 0 : -1;
 }
-#define strndup my_strndup
+
+int loadSource(const char *filename, Source *src) {
+    memset(src, 0, sizeof(*src));
+    if (!filename || readSource(filename, src) != 0) return -1;
+    return 0;
+}
+
+void freeSource(Source *src) {
+#ifdef HAVE_MMAP
+    if (src->mapped) munmap(src->data, src->size);
+    else
 #endif
+    free(src->data);
+    memset(src, 0, sizeof(*src));
+}
 
-void markCodeBlocks(const char **lines, int lineCount, int *isCodeLine) {
-    int insideFence = 0;
-    for (int i = 0; i < lineCount; i++) {
-	    const char *line = lines[i];
-    
-	    // skip leading spaces
-	    while (*line && isspace((unsigned char)*line)) {
-	        line++;
-	    }
+// make room in a growable array for one more element
+static int reserve(void **arr, int *cap, int count, size_t elemSize) {
+    if (count < *cap) return 0;
+    int newCap = *cap ? *cap * 2 : 64;
+    void *grown = realloc(*arr, (size_t)newCap * elemSize);
+    if (!grown) return -1;
+    *arr = grown;
+    *cap = newCap;
+    return 0;
+}
 
-        if (strncmp(line, "```", 3) == 0) {
-            insideFence = insideFence == 0 ? 1 : 0; // toggle
-            isCodeLine[i] = 1; // mark fence line as code
-        } else {
-            isCodeLine[i] = insideFence;
-        }	
+// printf into a message buffer; on allocation failure the message is dropped
+static void bufPrintf(TextBuf *buf, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n <= 0) return;
+    if (buf->len + (size_t)n + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 256;
+        while (cap < buf->len + (size_t)n + 1) cap *= 2;
+        char *grown = realloc(buf->data, cap);
+        if (!grown) return;
+        buf->data = grown;
+        buf->cap = cap;
     }
+    va_start(ap, fmt);
+    vsnprintf(buf->data + buf->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    buf->len += (size_t)n;
 }
 
-// Check if a given portion of a line (e.g. '[^footnote]') is inside inline code: start='[', end=']'
-int isInsideInlineCode(const char *line, const char *start, const char *end) {
-    bool inCode = 0;
-    int cite_idx = (int)(start - line); // index of '[' for this citation [^citeNum]
-    // scan left-to-right from beginning of line to just before '[' in [^citeNum]
-    for (int i = 0; i < cite_idx - 1; i++) {
-	    if (line[i] == '`' && line[i+1] == '`') {
-	        inCode = !inCode; // toggle
-	        i += 1; // skip next iteration
-	    }
+// append len bytes to a message buffer as they are, keeping it NUL-terminated.
+// Returns 0, or -1 if out of memory (the bytes are dropped).
+static int bufAppend(TextBuf *buf, const char *data, size_t len) {
+    if (buf->len + len + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 256;
+        while (cap < buf->len + len + 1) cap *= 2;
+        char *grown = realloc(buf->data, cap);
+        if (!grown) return -1;
+        buf->data = grown;
+        buf->cap = cap;
     }
-    const char *p = strstr(end + 1, "``"); // find first occurrence of '``' after ']' in [^citeNum]
-    if (inCode && p) return 1;
-    else return 0;
+    if (len) memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return 0;
 }
 
-int findInText(const char *line, const char **pos, char **label) {
-    const char *p;
-    if (!pos || *pos == NULL)
-        p = strstr(line, "[^");
-    else
-        p = strstr(*pos, "[^");
+// append the len bytes at s as a JSON string, quoted and escaped
+static void bufJsonBytes(TextBuf *buf, const char *s, size_t len) {
+    bufAppend(buf, "\"", 1);
+    size_t from = 0;
+    for (size_t k = 0; k < len; k++) {
+        unsigned char c = (unsigned char)s[k];
+        if (c != '"' && c != '\\' && c >= 0x20) continue;
+        bufAppend(buf, s + from, k - from);
+        if (c == '"' || c == '\\') bufPrintf(buf, "\\%c", c);
+        else bufPrintf(buf, "\\u%04x", c);
+        from = k + 1;
+    }
+    bufAppend(buf, s + from, len - from);
+    bufAppend(buf, "\"", 1);
+}
 
-    if (!p) return 0;
+// append s as a JSON string, quoted and escaped
+static void bufJsonString(TextBuf *buf, const char *s) {
+    bufJsonBytes(buf, s, strlen(s));
+}
 
-    const char *end = strchr(p + 2, ']');
-    if (!end) return 0; // no closing bracket anywhere → no citation in this line
-    
-    // check if footnote is inside inline code
-    if (isInsideInlineCode(line, p, end)) return 0;
+static double now(void) {
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    // Extract raw label (trim spaces inside)
-    const char *start = p + 2;
-    while (*start && isspace((unsigned char)*start)) start++; // skip leading spaces
+// the perror() equivalent for a message buffer
+static void reportErrno(TextBuf *err, const char *what) {
+    bufPrintf(err, "%s: %s\n", what, strerror(errno));
+}
 
-    const char *finish = end - 1;
-    while (finish >= start && isspace((unsigned char)*finish)) finish--; // trim trailing spaces
+void print_version(FILE *out) {
+    fprintf(out, "  citeorder " CITEORDER_VERSION " (GPL-3.0-or-later)\n");
+    fprintf(out, "  Copyright (c) 2025 Dhanushka Jayagoda\n");
+#if defined(__clang__)
+    fprintf(out, "  Built with clang %s\n", __clang_version__);
+#elif defined(__GNUC__)
+    fprintf(out, "  Built with gcc %d.%d.%d\n", __GNUC__, __GNUC_MINOR__, __GNUC_PATCHLEVEL__);
+#elif defined(_MSC_VER)
+    fprintf(out, "  Built with MSVC %d\n", _MSC_VER);
+#else
+    fprintf(out, "  Built with unknown compiler\n");
+#endif
+    fprintf(out, "  Build date: %s, %s\n", __DATE__, __TIME__);
+    fprintf(out, "  Homepage: https://github.com/dhanushka2001/citeorder\n");
+}
 
-    size_t len = finish - start + 1; // main() will handle case where len=0
+void print_help(FILE *out) {
+    fprintf(out, "citeorder - reorder Markdown footnotes\n\n");
+    fprintf(out, "Usage:\n");
+    fprintf(out, "  citeorder [options] input.md [more.md | dir ...]\n\n");
+    fprintf(out, "Description:\n");
+    fprintf(out, "  Processes a Markdown file and reorders its footnotes.\n");
+    fprintf(out, "  The result is written to 'input-fixed.md'.\n");
+    fprintf(out, "  Directories are searched recursively for '.md' files.\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  -q, --relaxed-quotes       Relaxed handling of quotation marks\n");
+    fprintf(out, "  -d, --relaxed-duplicates   Relaxed handling of duplicate footnotes (auto-increment)\n");
+    fprintf(out, "  -s, --stream               Stream large files in bounded memory ('-' reads stdin, writes stdout)\n");
+    fprintf(out, "  -j, --jobs N               Process up to N files in parallel (a single file on N threads)\n");
+    fprintf(out, "  -c, --check                Only check whether footnotes are in order (exit code 2 if not)\n");
+    fprintf(out, "  -w, --watch                Reprocess the file every time it is saved\n");
+    fprintf(out, "  -i, --in-place             Rewrite the input file instead of writing 'input-fixed.md'\n");
+    fprintf(out, "      --diff                 Print the changes as a unified diff instead of writing a file\n");
+    fprintf(out, "      --stats[=json]         Print the time each phase took and what was found, to stderr\n");
+    fprintf(out, "      --report=json          Print each file's footnotes, their new numbers and any error as JSON\n");
+    fprintf(out, "      --serve [FILE]         Answer JSON requests to renumber open documents, one per line\n");
+    fprintf(out, "      --cache[=FILE]         Skip files unchanged since the last run (default: .citeorder-cache)\n");
+    fprintf(out, "  -h, --help                 Show this help message\n");
+    fprintf(out, "  -v, --version              Show program version\n\n");
+    fprintf(out, "Version:\n");
+    print_version(out);
+}
+
+// Derive the output name: input.md -> input-fixed.md. Returns 0, or -1 with
+// errno set to ENAMETOOLONG if it does not fit in size bytes.
+static int fixedName(const char *filename, char *outName, size_t size) {
+    size_t len = strlen(filename);
+    const char *dot = strrchr(filename, '.');
+    if (dot && strcmp(dot, ".md") == 0) len = (size_t)(dot - filename);
+    if (len + sizeof("-fixed.md") > size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(outName, size, "%.*s-fixed.md", (int)len, filename);
+    return 0;
+}
 
-    *label = strndup(start, len); // caller must free
-    *pos = end + 1; // citation [^something] was found, move one space past ']'
+// --in-place: the document is written to a temporary file next to the input,
+// which is only renamed over it once complete and on disk, so the input is
+// never left half written
+typedef struct {
+    char tmpName[MAX_PATH_LEN];
+    FILE *f;
+} Replacement;
+
+static FILE *openReplacement(const char *filename, Replacement *rep) {
+    rep->f = NULL;
+    if (snprintf(rep->tmpName, sizeof(rep->tmpName), "%s.citeorder-XXXXXX", filename) >= (int)sizeof(rep->tmpName)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+#ifdef _WIN32
+    if (_mktemp_s(rep->tmpName, strlen(rep->tmpName) + 1) != 0) return NULL;
+    rep->f = fopen(rep->tmpName, "wb");
+#else
+    int fd = mkstemp(rep->tmpName);
+    if (fd < 0) return NULL;
+    // keep the permissions of the file being replaced
+    struct stat st;
+    if (stat(filename, &st) == 0) fchmod(fd, st.st_mode & 07777);
+    rep->f = fdopen(fd, "wb");
+    if (!rep->f) {
+        close(fd);
+        remove(rep->tmpName);
+    }
+#endif
+    return rep->f;
+}
 
-    return 1; // return 1 to keep while loop searching for single/stacked in-text footnotes
+// Flush the replacement to disk and rename it over filename. Returns 0, or -1
+// with errno set and the temporary file removed.
+static int commitReplacement(Replacement *rep, const char *filename) {
+    int rc = fflush(rep->f);
+#ifdef _WIN32
+    if (rc == 0) rc = _commit(_fileno(rep->f));
+#else
+    if (rc == 0) rc = fsync(fileno(rep->f));
+#endif
+    int saved = errno;
+    if (fclose(rep->f) != 0 && rc == 0) {
+        rc = -1;
+        saved = errno;
+    }
+    rep->f = NULL;
+    if (rc == 0) {
+#ifdef _WIN32
+        // rename() does not replace an existing file on Windows
+        if (!MoveFileExA(rep->tmpName, filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            rc = -1;
+            saved = EACCES;
+        }
+#else
+        rc = rename(rep->tmpName, filename);
+        saved = errno;
+#endif
+    }
+    if (rc != 0) {
+        remove(rep->tmpName);
+        errno = saved;
+    }
+    return rc;
 }
 
-// returns 1 if a valid full-entry footnote is found, else 0
-int findFullEntry(const char *line, char **label, const char **body) {
-    // must start with '[^', thus don't need to worry about being inside inline code
+static void discardReplacement(Replacement *rep) {
+    if (!rep->f) return;
+    fclose(rep->f);
+    rep->f = NULL;
+    remove(rep->tmpName);
+}
 
-    // skip leading spaces
-    while (*line && isspace((unsigned char)*line)) {
-        line++;
+// Copy standard input to a temporary file, which the later passes can re-read
+static FILE *spoolStdin(void) {
+    FILE *f = tmpfile();
+    if (!f) return NULL;
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
+        if (fwrite(chunk, 1, n, f) != n) { fclose(f); return NULL; }
     }
+    if (ferror(stdin)) { fclose(f); return NULL; }
+    rewind(f);
+    return f;
+}
 
-    if (strncmp(line, "[^", 2) != 0) return 0;
+// Print the outcome of processing a file into its message buffers: errors to
+// err, hints to hints. Returns the file's exit status.
+static int reportResult(const citeorder_result *res, TextBuf *err, TextBuf *hints) {
+    if (res->status == CITEORDER_OK) return 0;
+    if (res->status == CITEORDER_ERR_NO_MEMORY || res->status == CITEORDER_ERR_IO) {
+        bufPrintf(err, "%s\n", res->message ? res->message : "out of memory");
+    } else {
+        bufPrintf(err, "ERROR: %s\n", res->message ? res->message : "");
+    }
+    if (res->hint) bufPrintf(hints, "Help: %s\n", res->hint);
+    return 1;
+}
 
-    const char *p = line + 2; // skip "[^"
+// --check: say whether filename would be renumbered. Returns 2 if it would,
+// which sets it apart from an error.
+static int reportCheck(const char *filename, const Options *opts, const citeorder_result *res, TextBuf *out) {
+    if (res->changed) {
+        bufPrintf(out, "%s needs reordering (line %d)\n", strcmp(filename, "-") == 0 ? "stdin" : filename, res->line);
+        return 2;
+    }
+    if (opts->batch) bufPrintf(out, "No changes required in %s.\n", filename);
+    else bufPrintf(out, "No changes required.\n");
+    return 0;
+}
 
-    // find closing bracket
-    const char *end = strchr(p, ']');
-    if (!end) return 0;
+// --stats: print where the time went for filename and what was found in it.
+// It goes to err, so that it never mixes with a document or diff on stdout.
+static void reportStats(const char *filename, const Options *opts, const citeorder_result *res,
+                        const IoStats *io, TextBuf *err) {
+    static const char *phases[] = { "read", "index", "lex", "full entries", "in-text", "numbering", "render", "write" };
+    static const char *keys[] = { "read", "index", "lex", "full_entries", "in_texts", "numbering", "render", "write" };
+    const citeorder_stats *st = &res->stats;
+    const double seconds[] = { io->readTime, st->index_time, st->lex_time, st->full_entry_time,
+                               st->in_text_time, st->number_time, st->render_time, io->writeTime };
+    const char *name = strcmp(filename, "-") == 0 ? "stdin" : filename;
+    if (opts->statsJson) {
+        bufPrintf(err, "{\"file\":");
+        bufJsonString(err, name);
+        bufPrintf(err, ",\"ms\":{");
+        for (int k = 0; k < 8; k++) bufPrintf(err, "%s\"%s\":%.3f", k ? "," : "", keys[k], seconds[k] * 1e3);
+        bufPrintf(err, "},\"lines\":%ld,\"full_entries\":%ld,\"in_texts\":%ld,\"stacks\":%ld,"
+                       "\"quote_backtracks\":%ld,\"bytes_read\":%llu,\"bytes_written\":%llu}\n",
+                  st->lines, st->full_entries, st->in_texts, st->stacks, st->quote_backtracks,
+                  (unsigned long long)st->bytes_in, (unsigned long long)io->bytesWritten);
+        return;
+    }
+    bufPrintf(err, "Stats for %s:\n", name);
+    for (int k = 0; k < 8; k++) bufPrintf(err, "  %-14s%10.3f ms\n", phases[k], seconds[k] * 1e3);
+    bufPrintf(err, "  lines %ld, full entries %ld, in-text citations %ld, stacks %ld, quote backtracks %ld\n",
+              st->lines, st->full_entries, st->in_texts, st->stacks, st->quote_backtracks);
+    bufPrintf(err, "  bytes read %llu, bytes written %llu\n",
+              (unsigned long long)st->bytes_in, (unsigned long long)io->bytesWritten);
+}
 
-    // next character must be ':'
-    if (*(end + 1) != ':') return 0;
+// Where streaming mode writes: standard output for "-", otherwise the
+// '-fixed.md' file (or with --in-place, the replacement of the input), created
+// only once it is known something changed
+typedef struct {
+    const char *filename;
+    char outName[MAX_PATH_LEN];
+    FILE *dest;
+    int openErrno;
+    FILE *docOut;
+    int inPlace;
+    Replacement rep;
+} StreamTarget;
+
+static FILE *openStreamTarget(void *ctx, const citeorder_result *res) {
+    StreamTarget *target = ctx;
+    if (strcmp(target->filename, "-") == 0) {
+#ifdef _WIN32
+        _setmode(_fileno(target->docOut), _O_BINARY);
+#endif
+        return target->docOut;
+    }
+    if (!res->changed) return NULL;
+    if (target->inPlace) {
+        snprintf(target->outName, sizeof(target->outName), "%s", target->filename);
+        target->dest = openReplacement(target->filename, &target->rep);
+        if (!target->dest) target->openErrno = errno;
+        return target->dest;
+    }
+    if (fixedName(target->filename, target->outName, sizeof(target->outName)) != 0) {
+        target->openErrno = errno;
+        return NULL;
+    }
+    target->dest = fopen(target->outName, "wb");
+    if (!target->dest) target->openErrno = errno;
+    return target->dest;
+}
 
-    // extract label
-    size_t len = end - p;
+// Process one file in bounded memory. "-" reads standard input and writes the
+// result to standard output, whether or not anything changed.
+int processStream(const char *filename, const Options *opts, citeorder_result *res, TextBuf *out, TextBuf *err) {
+    int toStdout = strcmp(filename, "-") == 0;
+    IoStats io = { 0, 0, 0 };
+    double tick = opts->process.stats ? now() : 0;
+    FILE *f = toStdout ? spoolStdin() : fopen(filename, "rb");
+    if (!f) {
+        if (toStdout) {
+            reportErrno(err, "stdin");
+        } else {
+	        bufPrintf(err,
+		              "citeorder: file '%s' does not exist\nUsage: 'citeorder [options] input.md'\nHelp: 'citeorder [-h|--help]'\n",
+		              filename);
+        }
+        return 1;
+    }
 
-    // allocate label string
-    *label = strndup(p, len);  // caller must free
-    *body = end + 2;           // after "]:"
+    StreamTarget target = { filename, "", NULL, 0, opts->docOut, opts->inPlace, { "", NULL } };
+    if (opts->process.stats) io.readTime = now() - tick;
+    citeorder_stream(f, &opts->process, openStreamTarget, &target, res);
+    fclose(f);
+    if (opts->process.stats) tick = now();
+    // keep hints out of the document on stdout
+    int status = reportResult(res, err, toStdout ? err : out);
+    if (target.dest && target.inPlace) {
+        if (status != 0) {
+            discardReplacement(&target.rep);
+        } else if (commitReplacement(&target.rep, filename) != 0) {
+            reportErrno(err, "write");
+            status = 1;
+        }
+    } else if (target.dest && fclose(target.dest) != 0 && status == 0) {
+        reportErrno(err, "write");
+        status = 1;
+    }
+    if (status == 0 && opts->process.check) {
+        status = reportCheck(filename, opts, res, out);
+    } else if (status == 0 && !toStdout) {
+        if (target.openErrno) {
+            errno = target.openErrno;
+            reportErrno(err, "fopen");
+            status = 1;
+        } else if (res->changed) {
+	        bufPrintf(out, "Output written to %s\n", target.outName);
+        } else if (opts->batch) {
+            bufPrintf(out, "No changes required in %s.\n", filename);
+        } else {
+            bufPrintf(out, "No changes required.\n");
+        }
+    }
+    if (opts->process.stats) {
+        // the document was written as it was rendered
+        io.writeTime = now() - tick;
+        io.bytesWritten = res->stats.bytes_out;
+        reportStats(filename, opts, res, &io, err);
+    }
+    return status;
+}
 
-    return 1;
+// --diff: print the lines that would change as a unified diff, and nothing
+// if none would
+static int reportDiff(const char *filename, citeorder_result *res, TextBuf *out, TextBuf *err, size_t *bytesWritten) {
+    size_t len;
+    const char *diff = citeorder_result_diff(res, filename, &len);
+    if (!diff) {
+        bufPrintf(err, "out of memory\n");
+        return 1;
+    }
+    bufAppend(out, diff, len);
+    *bytesWritten = len;
+    return 0;
 }
 
-// scan line right-to-left looking for a '"' or a ']'
-int backScanForQuote(const char *line, int pos) {
-    for (int i = pos - 1; i >= 0; i--) {
-        // check if hit a previous in-text citation before reaching a quote
-   	    if (i > 2 && line[i] == ']') {
-   	        if (isdigit((unsigned char)line[i - 1]) &&
-                line[i - 2] == '^' && line[i - 3] == '[') {
-   	    	    return -2;
-   	        }
-   	    }
-        if (line[i] == '"') {
-	        return i;
-        }
-    }
-    // did not find '"' or '[^n]' in line
-    return -1;
-}
-
-// Check if citation is properly after quotes/punctuation
-int hasProperQuoteContext(const char **lines, int lineNum, const char *pos) {
-    const char *line = lines[lineNum];
-    
-    // pos given from findInText(), the position after ']' in [^citeNum]
-    int q = (int)(pos - line);
-    // search backwards from ']' to have q point to '['
-    while (q > 0) {
-        if (line[q-1] == '[' && line[q] == '^') {
-            q--;
-            break;
-        }
-        q--;
+// Replace filename with the renumbered document. Returns 0, or -1 with errno set.
+static int writeInPlace(const char *filename, const citeorder_result *res) {
+    Replacement rep;
+    if (!openReplacement(filename, &rep)) return -1;
+    if (citeorder_result_write(res, rep.f) != 0) {
+        int saved = errno;
+        discardReplacement(&rep);
+        errno = saved;
+        return -1;
     }
+    return commitReplacement(&rep, filename);
+}
 
-    int cite_idx = q; //(int)(p - line);   // index of '[' for this exact unique citation [^citeNum]
+// Report the result of processing filename and, if it changed, write it to
+// 'input-fixed.md' (or over filename itself), setting *bytesWritten to what
+// was written. Returns the file's exit status.
+static int writeFixed(const char *filename, const Options *opts, citeorder_result *res, TextBuf *out, TextBuf *err,
+                      size_t *bytesWritten) {
+    // keep hints out of a diff or report
+    int status = reportResult(res, err, opts->process.diff || opts->process.report ? err : out);
+    if (status == 0 && opts->process.check) return reportCheck(filename, opts, res, out);
+    if (status == 0 && opts->process.diff) return reportDiff(filename, res, out, err, bytesWritten);
 
-    q--; // q pointing to the left of cite_idx '['
-    
-    // check if cite_idx '[' is to the left of a closing footnote ']'
-    if (line[q] == ']') {
-        // scan backwards for '[^', leaving enough room for at least "A"
-        while (q > 3) {
-            // if to the left of a stack, return true (already checked footnotes to the left) 
-            if (line[q-1] == '[' && line[q] == '^') {
-                return 1;
+    // Output to new file
+    // ------------------
+    if (status == 0 && res->changed && opts->inPlace) {
+        if (writeInPlace(filename, res) != 0) {
+            reportErrno(err, "write");
+            status = 1;
+        } else {
+            bufPrintf(out, "Output written to %s\n", filename);
+            *bytesWritten = res->stats.bytes_out;
+        }
+    } else if (status == 0 && res->changed) {
+        char outName[MAX_PATH_LEN];
+        FILE *f = fixedName(filename, outName, sizeof(outName)) == 0 ? fopen(outName, "wb") : NULL;
+        if (!f) {
+            reportErrno(err, "fopen");
+            status = 1;
+        } else {
+            int written = citeorder_result_write(res, f);
+            if (fclose(f) != 0) written = -1;
+            if (written != 0) {
+                reportErrno(err, "write");
+                status = 1;
+            } else {
+	            bufPrintf(out, "Output written to %s\n", outName);
+                *bytesWritten = res->stats.bytes_out;
             }
-            q--;
         }
-        // could not find opening '[^' for ']' to its left, therefore not proper quote context
-        return 0;
+    } else if (status == 0) {
+	    if (opts->batch) bufPrintf(out, "No changes required in %s.\n", filename);
+	    else bufPrintf(out, "No changes required.\n");
     }
+    return status;
+}
 
-    int end_quote = 0;
-    char c = line[cite_idx - 1];
-    // check if cite_idx '[' is to the left of an end quote '"'
-    if (c == '"') {
-	    end_quote = cite_idx - 1;
+// --report: write the result as writeFixed() does, but print the outcome as a
+// line of JSON in place of its messages (errors still go to err as well)
+static int writeReported(const char *filename, const Options *opts, citeorder_result *res, TextBuf *out, TextBuf *err,
+                         size_t *bytesWritten) {
+    TextBuf msgs = { NULL, 0, 0 };
+    int status = writeFixed(filename, opts, res, &msgs, err, bytesWritten);
+    free(msgs.data);
+    size_t len;
+    const char *report = citeorder_result_report(res, filename, &len);
+    if (!report) {
+        bufPrintf(err, "out of memory\n");
+        return 1;
     }
-    // allow at most 1 punctuation directly after the end quote
-    if (c == ',' || c == '.' || c == ';' || c == ':' || c == '?' || c == '!' || c == ')') {
-	    if (line[cite_idx - 2] == '"') {
-	        end_quote = cite_idx - 2;
-	    }
+    bufAppend(out, report, len);
+    return status;
+}
+
+// Load filename whole into src, or complain to err that it cannot be read.
+// Returns 0, or 1 (the file's exit status) if it cannot.
+static int loadInput(const char *filename, const Options *opts, Source *src, IoStats *io, TextBuf *err) {
+    double tick = opts->process.stats ? now() : 0;
+    if (loadSource(filename, src) != 0) { 
+	    bufPrintf(err,
+		          "citeorder: file '%s' does not exist\nUsage: 'citeorder [options] input.md'\nHelp: 'citeorder [-h|--help]'\n",
+		          filename);
+	    freeSource(src);
+	    return 1;
     }
-    
-    // If there is no closing quote before the citation, it's invalid.
-    if (end_quote == 0) return 0;
+    if (opts->process.stats) io->readTime = now() - tick;
+    return 0;
+}
+
+// processFile() for a file already loaded into src
+static int processSource(const char *filename, const Options *opts, const Source *src, IoStats *io,
+                         citeorder_result *res, TextBuf *out, TextBuf *err) {
+    citeorder_process(src->data, src->size, &opts->process, res);
+    double tick = opts->process.stats ? now() : 0;
+    int status = opts->process.report ? writeReported(filename, opts, res, out, err, &io->bytesWritten)
+                                      : writeFixed(filename, opts, res, out, err, &io->bytesWritten);
+    if (opts->process.stats) {
+        io->writeTime = now() - tick;
+        reportStats(filename, opts, res, io, err);
+    }
+    return status;
+}
+
+// Process one Markdown file: check its footnotes and write 'input-fixed.md'.
+// Messages meant for stdout and stderr are collected in out and err rather than
+// printed, and nothing here touches shared state, so files can be processed in
+// parallel. res is the caller's scratch result, reused from file to file so
+// that its memory is recycled. Returns the file's exit status.
+int processFile(const char *filename, const Options *opts, citeorder_result *res, TextBuf *out, TextBuf *err) {
+    if (opts->stream || strcmp(filename, "-") == 0) {
+        return processStream(filename, opts, res, out, err);
+    }
+
+    IoStats io = { 0, 0, 0 };
+    Source src;
+    if (loadInput(filename, opts, &src, &io, err) != 0) return 1;
+    int status = processSource(filename, opts, &src, &io, res, out, err);
+    freeSource(&src);
+    return status;
+}
+
+// Result cache
+// ------------
+// With --cache, each file's outcome is remembered by path along with a hash
+// of its contents and the options that affect it. A file whose contents and
+// options match its entry (and whose 'input-fixed.md', if any, is still what
+// was written) is reported as before without being parsed. The cache file is
+// rewritten whole: under a lock, it is read again, this run's outcomes are
+// merged in, and the result is renamed over it, so that parallel runs neither
+// lose each other's entries nor ever read a partial file.
+
+// a new version may come to different outcomes, so it starts a new cache
+#define CACHE_MAGIC "citeorder-cache 1 " CITEORDER_VERSION
+
+enum { CACHE_RELAXED_QUOTES = 1, CACHE_RELAXED_DUPLICATES = 2, CACHE_CHECK = 4 };
+
+static unsigned cacheFlags(const Options *opts) {
+    return (opts->process.relaxed_quotes ? CACHE_RELAXED_QUOTES : 0) |
+           (opts->process.relaxed_duplicates ? CACHE_RELAXED_DUPLICATES : 0) |
+           (opts->process.check ? CACHE_CHECK : 0);
+}
+
+// XXH64 (seed 0): hashing a file is several times faster than parsing it
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
 
-    // Scan right-to-left to before closing quote to find opening quote, must be before a previous in-text citation, could be in a line prior.
-    int var = backScanForQuote(line, end_quote);
-    if (var == -2) return 0; // backScanForQuote() found an in-text citation before an opening quote
-    if (var >= 0) return 1; // backScanForQuote() found the opening quote
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
 
-    // did not find opening quote in the same line, loop through all previous lines to find it
-    for (int i = 0; i < lineNum; i++) {
-	    const char *pline = lines[lineNum - 1 - i];
-	    size_t len = strlen(pline);
-	    int var = backScanForQuote(pline, len);
-	    if (var == -2) return 0;
-	    if (var >= 0) return 1;
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t v) {
+    acc ^= xxhRound(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t hashContent(const char *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data, *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = 0 - XXH_P1;
+        do {
+            v1 = xxhRound(v1, read64(p));
+            v2 = xxhRound(v2, read64(p + 8));
+            v3 = xxhRound(v3, read64(p + 16));
+            v4 = xxhRound(v4, read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxhMerge(h, v1);
+        h = xxhMerge(h, v2);
+        h = xxhMerge(h, v3);
+        h = xxhMerge(h, v4);
+    } else {
+        h = XXH_P5;
+    }
+    h += (uint64_t)len;
+    for (; end - p >= 8; p += 8) {
+        h ^= xxhRound(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
     }
-    // could not find an opening quote in any of the lines
+    if (end - p >= 4) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (uint64_t)k * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// hash a whole file; returns 0, or -1 if it cannot be read
+static int hashFile(const char *filename, uint64_t *hash, uint64_t *size) {
+    Source src;
+    if (loadSource(filename, &src) != 0) {
+        freeSource(&src);
+        return -1;
+    }
+    *hash = hashContent(src.data, src.size);
+    *size = src.size;
+    freeSource(&src);
     return 0;
 }
 
-// Update in-text citations in a line, keeping stacked citations sorted
-void updateLineInTexts(char *line, InText *inTexts, int inCount, int lineIdx) {
-    char *p = line;
-    // recursively search for start of footnotes (single or stacked)
-    while ((p = strstr(p, "[^")) != NULL) {
-        char *stackStart = p;
-        char *stackEnd = p;
-        int count = 0;
-
-        // count stacked [^...]
-        while (stackEnd && strncmp(stackEnd, "[^", 2) == 0) {
-            char *endbr = strchr(stackEnd, ']');
-            if (!endbr) break;
-            stackEnd = endbr + 1;
-            count++;
-        }
+static void freeCacheEntry(CacheEntry *e) {
+    free(e->path);
+    free(e->message);
+    free(e->hint);
+    memset(e, 0, sizeof(*e));
+}
 
-        if (count > 1) {
-            // --- stacked citation ---
-            const int MAX_STACK = 16;
-            int nums[MAX_STACK];
-            char *q = stackStart;
-            int k = 0;
-            int any_missing = 0;
-        
-            // Parse each [^ ... ] within the stack without mutating the line
-            while (k < count) {
-                // find next "[^"
-                char *footnoteStart = strstr(q, "[^");
-                if (!footnoteStart || footnoteStart >= stackEnd) break;
-        
-                char *footnoteEnd = strchr(footnoteStart, ']');
-                if (!footnoteEnd || footnoteEnd >= stackEnd) break;
-        
-                // label bounds (don't mutate)
-                char *label_s = footnoteStart + 2;        // first char after "[^"
-                char *label_e = footnoteEnd - 1;          // last char before ']'
-        
-                // trim by scanning (no memmove)
-                while (label_s <= label_e && isspace((unsigned char)*label_s)) label_s++;
-                while (label_e >= label_s && isspace((unsigned char)*label_e)) label_e--;
-        
-                // copy trimmed label
-                char labelbuf[128];
-                if (label_s > label_e) {
-                    labelbuf[0] = '\0';
-                } else {
-                    int lablen = (int)(label_e - label_s + 1);
-                    if (lablen >= (int)sizeof(labelbuf)) lablen = (int)sizeof(labelbuf) - 1;
-                    memcpy(labelbuf, label_s, (size_t)lablen);
-                    labelbuf[lablen] = '\0';
-                }
-        
-                // lookup newNum
-                int newNum = -1;
-                for (int j = 0; j < inCount; j++) {
-                    if (inTexts[j].lineIdx == lineIdx && strcmp(inTexts[j].label, labelbuf) == 0) {
-                        newNum = inTexts[j].newNum;
-                        break;
-                    }
-                }
-                if (newNum == -1) any_missing = 1;
-                nums[k++] = newNum;
-        
-                // advance q to just after this footnote's closing ']'
-                q = footnoteEnd + 1;
-            }
-        
-            // If something went wrong (missing mapping or parsed fewer tokens), skip modifying this stack
-            if (k != count || any_missing) {
-                // safe fallback: do not touch this stack
-                p = stackEnd;
-                continue;
-            }
-        
-            // sort nums ascending
-            for (int a = 0; a < k - 1; a++)
-                for (int b = a + 1; b < k; b++)
-                    if (nums[a] > nums[b]) {
-                        int tmp = nums[a]; nums[a] = nums[b]; nums[b] = tmp;
-                    }
-        
-            // build replacement stack string
-            char newStack[512];
-            size_t np = 0;
-            for (int i = 0; i < k; i++) {
-                int written = snprintf(newStack + np, sizeof(newStack) - np, "[^%d]", nums[i]);
-                if (written < 0 || (size_t)written >= sizeof(newStack) - np) break; // overflow safe-guard
-                np += (size_t)written;
-            }
-            newStack[np] = '\0';
-        
-            // replace the entire original stack (stackStart .. stackEnd-1) with newStack
-            size_t tail_len = strlen(stackEnd);
-            memmove(stackStart + np, stackEnd, tail_len + 1); // shift tail
-            memcpy(stackStart, newStack, np);                 // write new stack
-        
-            // continue scanning after replaced stack
-            p = stackStart + np;
-        } else {
-            // --- single citation ---
-            char *caret = strchr(stackStart, '^');   // points at '^'
-            if (!caret) { p = stackStart + 2; continue; }
-
-            char *endbr = strchr(caret, ']');        // points at ']'
-            if (!endbr) { p = caret + 1; continue; }
-
-            // compute trimmed label boundaries (do NOT mutate the original string)
-            char *label_s = caret + 1;   // first char after '^'
-            char *label_e = endbr - 1;   // last char before ']'
-            while (label_s <= label_e && isspace((unsigned char)*label_s)) label_s++;
-            while (label_e >= label_s && isspace((unsigned char)*label_e)) label_e--;
-
-            // copy trimmed label to a buffer for strcmp
-            char labelbuf[128];
-            int lablen = (label_s > label_e) ? 0 : (int)(label_e - label_s + 1);
-            if (lablen >= (int)sizeof(labelbuf)) lablen = (int)sizeof(labelbuf) - 1;
-            if (lablen > 0) memcpy(labelbuf, label_s, (size_t)lablen);
-            labelbuf[lablen] = '\0';
-
-            // look up the new number
-            int newNum = -1;
-            for (int j = 0; j < inCount; j++) {
-                if (inTexts[j].lineIdx == lineIdx && strcmp(inTexts[j].label, labelbuf) == 0) {
-                    newNum = inTexts[j].newNum;
-                    break;
-                }
-            }
+void freeCache(Cache *cache) {
+    for (int k = 0; k < cache->count; k++) freeCacheEntry(&cache->entries[k]);
+    free(cache->entries);
+    memset(cache, 0, sizeof(*cache));
+}
 
-            if (newNum != -1) {
-                // write the numeric label immediately after '^' (caret+1),
-                // then move the ']' and tail to be immediately after the number
-                char newStr[16];
-                int nlen = snprintf(newStr, sizeof(newStr), "%d", newNum);
+// entries are ordered by path, then options
+static int compareEntries(const void *a, const void *b) {
+    const CacheEntry *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : (x->flags > y->flags) - (x->flags < y->flags);
+}
 
-                // move tail (from ']' onward) to its new position
-                memmove(caret + 1 + nlen, endbr, strlen(endbr) + 1); // includes '\0'
+static CacheEntry *findCached(const Cache *cache, const char *path, unsigned flags) {
+    CacheEntry key = { 0 };
+    key.path = (char *)path;
+    key.flags = flags;
+    return cache->count ? bsearch(&key, cache->entries, (size_t)cache->count, sizeof(CacheEntry), compareEntries) : NULL;
+}
 
-                // copy the digits into place (overwriting any leading spaces)
-                memcpy(caret + 1, newStr, (size_t)nlen);
+// A field of a cache line, which is tab-separated: tabs, newlines and
+// backslashes in it are escaped
+static void writeField(FILE *f, const char *s) {
+    for (; s && *s; s++) {
+        if (*s == '\\') fputs("\\\\", f);
+        else if (*s == '\t') fputs("\\t", f);
+        else if (*s == '\n') fputs("\\n", f);
+        else if (*s == '\r') fputs("\\r", f);
+        else fputc(*s, f);
+    }
+}
 
-                // advance p to just after the closing ']'
-                p = caret + 1 + nlen + 1;
-            } else {
-                // no mapping found; leave it alone and continue after the ']'
-                p = endbr + 1;
-            }
+// copy a field of len bytes at s, undoing writeField(); NULL if it is empty
+static char *readField(const char *s, size_t len, int *failed) {
+    if (len == 0) return NULL;
+    char *field = malloc(len + 1);
+    if (!field) {
+        *failed = 1;
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t k = 0; k < len; k++) {
+        char c = s[k];
+        if (c == '\\' && k + 1 < len) {
+            c = s[++k];
+            if (c == 't') c = '\t';
+            else if (c == 'n') c = '\n';
+            else if (c == 'r') c = '\r';
         }
+        field[n++] = c;
     }
+    field[n] = '\0';
+    return field;
 }
 
-void print_version(void) {
-    printf("  citeorder 1.2.1 (GPL-3.0-or-later)\n");
-    printf("  Copyright (c) 2025 Dhanushka Jayagoda\n");
-#if defined(__clang__)
-    printf("  Built with clang %s\n", __clang_version__);
-#elif defined(__GNUC__)
-    printf("  Built with gcc %d.%d.%d\n", __GNUC__, __GNUC_MINOR__, __GNUC_PATCHLEVEL__);
-#elif defined(_MSC_VER)
-    printf("  Built with MSVC %d\n", _MSC_VER);
-#else
-    printf("  Built with unknown compiler\n");
-#endif
-    printf("  Build date: %s, %s\n", __DATE__, __TIME__);
-    printf("  Homepage: https://github.com/dhanushka2001/citeorder\n");
-}
-
-void print_help(void) {
-    printf("citeorder - reorder Markdown footnotes\n\n");
-    printf("Usage:\n");
-    printf("  citeorder [options] input.md\n\n");
-    printf("Description:\n");
-    printf("  Processes a Markdown file and reorders its footnotes.\n");
-    printf("  The result is written to 'input-fixed.md'.\n\n");
-    printf("Options:\n");
-    printf("  -q, --relaxed-quotes       Relaxed handling of quotation marks\n");
-    printf("  -d, --relaxed-duplicates   Relaxed handling of duplicate footnotes (auto-increment)\n");
-    printf("  -h, --help                 Show this help message\n");
-    printf("  -v, --version              Show program version\n\n");
-    printf("Version:\n");
-    print_version();
-}
-
-// helper: check if string is purely digits
-bool isNumeric(const char *s) {
-    if (!s || !*s) return false;
-    for (const char *p = s; *p; ++p) {
-        if (!isdigit((unsigned char)*p))
-            return false;
+// Parse one line of a cache file into e. Returns 0, or -1 if it is malformed
+// (or out of memory), in which case the line is skipped.
+static int parseEntry(const char *s, const char *end, CacheEntry *e) {
+    // hash, size, flags, status, changed, line, output hash, message, hint, path
+    const char *fields[10];
+    size_t lens[10];
+    int n = 0;
+    const char *p = s;
+    while (n < 10) {
+        const char *tab = n < 9 ? memchr(p, '\t', (size_t)(end - p)) : end;
+        if (!tab) return -1;
+        fields[n] = p;
+        lens[n++] = (size_t)(tab - p);
+        p = tab + 1;
     }
-    return true;
+    char num[32];
+    unsigned long long v[7];
+    for (int k = 0; k < 7; k++) {
+        if (lens[k] == 0 || lens[k] >= sizeof(num)) return -1;
+        memcpy(num, fields[k], lens[k]);
+        num[lens[k]] = '\0';
+        char *rest;
+        v[k] = strtoull(num, &rest, k == 0 || k == 6 ? 16 : 10);
+        if (*rest != '\0') return -1;
+    }
+    int failed = 0;
+    memset(e, 0, sizeof(*e));
+    e->hash = v[0];
+    e->size = v[1];
+    e->flags = (unsigned)v[2];
+    e->status = (int)v[3];
+    e->changed = (int)v[4];
+    e->line = (int)v[5];
+    e->outHash = v[6];
+    e->message = readField(fields[7], lens[7], &failed);
+    e->hint = readField(fields[8], lens[8], &failed);
+    e->path = readField(fields[9], lens[9], &failed);
+    if (failed || !e->path) {
+        freeCacheEntry(e);
+        return -1;
+    }
+    return 0;
 }
 
-// helper: check if a citation changed
-bool entryChanged(const char *label, int newNum) {
-    char numStr[16];
-    snprintf(numStr, sizeof(numStr), "%d", newNum);
-    return !isNumeric(label) || strcmp(label, numStr) != 0;
+// Read the cache file at path into cache, sorted. A missing file, or one
+// written by another version, is an empty cache. Returns 0, or -1 if out
+// of memory.
+static int loadCache(const char *path, Cache *cache) {
+    memset(cache, 0, sizeof(*cache));
+    Source src;
+    if (loadSource(path, &src) != 0) {
+        freeSource(&src);
+        return 0;
+    }
+    const char *p = src.data, *end = src.data + src.size;
+    const char *nl = src.size ? memchr(p, '\n', src.size) : NULL;
+    size_t magic = strlen(CACHE_MAGIC);
+    if (!nl || (size_t)(nl - p) != magic || memcmp(p, CACHE_MAGIC, magic) != 0) {
+        freeSource(&src);
+        return 0;
+    }
+    int rc = 0;
+    for (p = nl + 1; p < end; p = nl + 1) {
+        nl = memchr(p, '\n', (size_t)(end - p));
+        if (!nl) break; // a line is only complete with its '\n'
+        if (reserve((void **)&cache->entries, &cache->cap, cache->count, sizeof(CacheEntry)) != 0) {
+            rc = -1;
+            break;
+        }
+        if (parseEntry(p, nl, &cache->entries[cache->count]) == 0) cache->count++;
+    }
+    freeSource(&src);
+    qsort(cache->entries, (size_t)cache->count, sizeof(CacheEntry), compareEntries);
+    return rc;
 }
 
-void cleanup(const char **lines, int lineCount, FullEntry *fullEntries, InText *inTexts, int fullCount, int inCount) {
-    for (int i = 0; i < lineCount; i++) {
-        if(lines[i] != NULL) {
-            // Cast away the 'const' qualifier to satisfy free() function signature
-            free((char *)lines[i]);
-            lines[i] = NULL; // optional, good practice
+// Hold an exclusive lock on "<path>.lock" while the cache is merged. Returns
+// the lock's descriptor, or -1 if locking is not possible (the cache is then
+// still replaced atomically, but a parallel run's entries may be lost).
+static int lockCache(const char *path) {
+    char lockName[520];
+    if (snprintf(lockName, sizeof(lockName), "%s.lock", path) >= (int)sizeof(lockName)) return -1;
+#ifdef _WIN32
+    int fd = _open(lockName, _O_RDWR | _O_CREAT, _S_IREAD | _S_IWRITE);
+    if (fd < 0) return -1;
+    // _LK_LOCK retries for about ten seconds
+    while (_locking(fd, _LK_LOCK, 1) != 0) {
+        if (errno != EDEADLOCK) {
+            _close(fd);
+            return -1;
+        }
+    }
+#else
+    int fd = open(lockName, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) return -1;
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
         }
     }
-    // No need to free(lines) because the array itself is on the stack.
-    
-    for (int i = 0; i < fullCount; i++) {
-        if (fullEntries[i].label != NULL) {
-            free(fullEntries[i].label);
-            fullEntries[i].label == NULL;
+#endif
+    return fd;
+}
+
+static void unlockCache(int fd) {
+    if (fd < 0) return;
+#ifdef _WIN32
+    _locking(fd, _LK_UNLCK, 1);
+    _close(fd);
+#else
+    close(fd); // releases the lock
+#endif
+}
+
+// Merge the outcomes remembered by this run's jobs into the cache file at path.
+// Entries of files that no longer exist are dropped. Returns 0, or -1 with errno set.
+static int saveCache(const char *path, const Job *jobs, int count) {
+    int updates = 0;
+    for (int k = 0; k < count; k++) {
+        if (jobs[k].cached.path) updates++;
+    }
+    if (updates == 0) return 0;
+
+    int lock = lockCache(path);
+    // what other runs wrote since this one started
+    Cache cache;
+    if (loadCache(path, &cache) != 0) {
+        freeCache(&cache);
+        unlockCache(lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    int sorted = cache.count;
+    for (int k = 0; k < count; k++) {
+        const CacheEntry *update = &jobs[k].cached;
+        if (!update->path) continue;
+        // the job keeps its own copy
+        CacheEntry copy = *update;
+        copy.path = strdup(update->path);
+        copy.message = update->message ? strdup(update->message) : NULL;
+        copy.hint = update->hint ? strdup(update->hint) : NULL;
+        if (!copy.path || (update->message && !copy.message) || (update->hint && !copy.hint)) {
+            freeCacheEntry(&copy);
+            continue;
         }
+        CacheEntry *e = sorted ? bsearch(update, cache.entries, (size_t)sorted, sizeof(CacheEntry), compareEntries) : NULL;
+        if (e) {
+            freeCacheEntry(e);
+        } else if (reserve((void **)&cache.entries, &cache.cap, cache.count, sizeof(CacheEntry)) == 0) {
+            e = &cache.entries[cache.count++];
+        } else {
+            freeCacheEntry(&copy);
+            continue;
+        }
+        *e = copy;
     }
-    for (int i = 0; i < inCount; i++) {
-        if (inTexts[i].label != NULL) {
-            free(inTexts[i].label);
-            inTexts[i].label == NULL;
+    qsort(cache.entries, (size_t)cache.count, sizeof(CacheEntry), compareEntries);
+
+    Replacement rep;
+    int rc = -1;
+    if (openReplacement(path, &rep)) {
+        fprintf(rep.f, "%s\n", CACHE_MAGIC);
+        for (int k = 0; k < cache.count; k++) {
+            const CacheEntry *e = &cache.entries[k];
+            struct stat st;
+            // a file given twice is written once
+            if (k > 0 && compareEntries(e, &cache.entries[k - 1]) == 0) continue;
+            if (stat(e->path, &st) != 0) continue;
+            fprintf(rep.f, "%016llx\t%llu\t%u\t%d\t%d\t%d\t%016llx\t",
+                    (unsigned long long)e->hash, (unsigned long long)e->size, e->flags,
+                    e->status, e->changed, e->line, (unsigned long long)e->outHash);
+            writeField(rep.f, e->message);
+            fputc('\t', rep.f);
+            writeField(rep.f, e->hint);
+            fputc('\t', rep.f);
+            writeField(rep.f, e->path);
+            fputc('\n', rep.f);
+        }
+        if (ferror(rep.f)) {
+            int saved = errno;
+            discardReplacement(&rep);
+            errno = saved;
+        } else {
+            rc = commitReplacement(&rep, path);
         }
     }
+    int saved = errno;
+    freeCache(&cache);
+    unlockCache(lock);
+    errno = saved;
+    return rc;
 }
 
-int main(int argc, char **argv) {
-    int relaxedQuotes = 0;
-    int incrementDuplicates = 0;
-    int num_dup_full_entry = 0;
-    const char *dup_full_entry = NULL;
-    int num_dup_in_text = 0;
-    const char *filename = NULL;
+// Whether e still describes filename, whose contents hash to hash, under opts
+static bool cacheHit(const CacheEntry *e, const char *filename, const Options *opts, uint64_t hash, uint64_t size) {
+    if (e->hash != hash || e->size != size) return false;
+    if (e->status != CITEORDER_OK || !e->changed || opts->process.check) return true;
+    // the renumbered document must be written again unless it is still there
+    if (opts->inPlace) return false;
+    char outName[MAX_PATH_LEN];
+    uint64_t outHash, outSize;
+    return fixedName(filename, outName, sizeof(outName)) == 0 &&
+           hashFile(outName, &outHash, &outSize) == 0 && outHash == e->outHash;
+}
 
-    if (argc < 2) { 
-	    printf("citeorder: missing operand\nUsage: 'citeorder [options] input.md'\nHelp: 'citeorder [-h|--help]'\n");
-	    return 1;
+// Report a cached outcome as processing the file again would have
+static int replayCached(const char *filename, const Options *opts, const CacheEntry *e, TextBuf *out, TextBuf *err) {
+    citeorder_result res = { 0 };
+    res.status = (citeorder_status)e->status;
+    res.line = e->line;
+    res.message = e->message;
+    res.hint = e->hint;
+    res.changed = e->changed;
+    int status = reportResult(&res, err, out);
+    if (status == 0 && opts->process.check) return reportCheck(filename, opts, &res, out);
+    if (status == 0 && res.changed) {
+        // a hit means the -fixed.md was found, so its name fits
+        char outName[MAX_PATH_LEN];
+        fixedName(filename, outName, sizeof(outName));
+        bufPrintf(out, "Output written to %s\n", outName);
+    } else if (status == 0) {
+	    if (opts->batch) bufPrintf(out, "No changes required in %s.\n", filename);
+	    else bufPrintf(out, "No changes required.\n");
     }
+    return status;
+}
 
+// Remember in e what processing filename came to. Failures to read or write
+// files, and running out of memory, are not remembered.
+static void rememberOutcome(CacheEntry *e, const char *filename, const Options *opts,
+                            const citeorder_result *res, int status, uint64_t hash, uint64_t size) {
+    if (res->status == CITEORDER_ERR_NO_MEMORY || res->status == CITEORDER_ERR_IO) return;
+    if (status == 1 && res->status == CITEORDER_OK) return;
+    memset(e, 0, sizeof(*e));
+    e->hash = hash;
+    e->size = size;
+    e->flags = cacheFlags(opts);
+    e->status = res->status;
+    e->line = res->line;
+    e->changed = res->changed;
+    if (status == 0 && res->changed && !opts->process.check) {
+        if (opts->inPlace) {
+            // the file now holds the renumbered document, which needs no changes
+            if (hashFile(filename, &e->hash, &e->size) != 0) return;
+            e->changed = 0;
+        } else {
+            char outName[MAX_PATH_LEN];
+            uint64_t outSize;
+            if (fixedName(filename, outName, sizeof(outName)) != 0 ||
+                hashFile(outName, &e->outHash, &outSize) != 0) return;
+        }
+    }
+    if ((res->message && !(e->message = strdup(res->message))) ||
+        (res->hint && !(e->hint = strdup(res->hint))) ||
+        !(e->path = strdup(filename))) {
+        freeCacheEntry(e);
+    }
+}
 
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            print_help();
-            return 0;
-        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--version") == 0) {
-            print_version();
-            return 0;
-        } else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--relaxed-quotes") == 0) {
-	        relaxedQuotes = 1;
-        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--relaxed-duplicates") == 0) {
-            incrementDuplicates = 1;
-	    } else {
-	        filename = argv[i];
-	    }
+// processFile(), skipped for a file whose outcome is in the cache. The outcome
+// of a file that is processed is left in *cached, for saveCache().
+static int processCached(const char *filename, const Options *opts, citeorder_result *res,
+                         TextBuf *out, TextBuf *err, CacheEntry *cached) {
+    if (!opts->cache) return processFile(filename, opts, res, out, err);
+    // the file is read once, and the outcome remembered under the hash of the
+    // bytes that were processed (streaming reads it again in any case)
+    uint64_t hash, size;
+    IoStats io = { 0, 0, 0 };
+    Source src;
+    if (opts->stream) {
+        if (hashFile(filename, &hash, &size) != 0) return processFile(filename, opts, res, out, err);
+    } else {
+        if (loadInput(filename, opts, &src, &io, err) != 0) return 1;
+        hash = hashContent(src.data, src.size);
+        size = src.size;
     }
-    
-    FILE *f = fopen(filename, "r");
-    if (!f) { 
-	    // perror("fopen");
-	    fprintf(stderr,
-		        "citeorder: file '%s' does not exist\nUsage: 'citeorder [options] input.md'\nHelp: 'citeorder [-h|--help]'\n",
-		        filename);
-	    return 1;
+    const CacheEntry *e = findCached(opts->cache, filename, cacheFlags(opts));
+    int status;
+    if (e && cacheHit(e, filename, opts, hash, size)) {
+        status = replayCached(filename, opts, e, out, err);
+    } else {
+        status = opts->stream ? processFile(filename, opts, res, out, err)
+                              : processSource(filename, opts, &src, &io, res, out, err);
+        rememberOutcome(cached, filename, opts, res, status, hash, size);
     }
+    if (!opts->stream) freeSource(&src);
+    return status;
+}
 
-    const char *lines[MAX_LINES]; // "lines" is a pointer to an array of const char pointers
-    int lineCount=0;
-    char buf[MAX_LINE_LEN];
+static int compareNames(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-    while(fgets(buf,sizeof(buf),f)) {
-        lines[lineCount] = strdup(buf);
-        lineCount++;
+// Add filename to the job list, or every Markdown file below it if it is a
+// directory. Directory entries are visited in name order so that runs are
+// reproducible; hidden entries and our own '-fixed.md' outputs are skipped.
+static int collectFiles(const char *filename, JobList *jobs, int fromDir) {
+    struct stat st;
+#ifndef _WIN32
+    // symlinks to directories are not followed inside a tree: one pointing back
+    // up it would list the same files again, down to the OS's nesting limit
+    if (fromDir && lstat(filename, &st) == 0 && S_ISLNK(st.st_mode) &&
+        stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) return 0;
+#endif
+    if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(filename);
+        if (!dir) return -1;
+        char **names = NULL;
+        int count = 0, cap = 0;
+        int rc = 0;
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_name[0] == '.') continue;
+            if (reserve((void **)&names, &cap, count, sizeof(char *)) != 0) {
+                rc = -1;
+                break;
+            }
+            size_t len = strlen(filename) + strlen(ent->d_name) + 2;
+            names[count] = malloc(len);
+            if (!names[count]) {
+                rc = -1;
+                break;
+            }
+            const char *sep = filename[strlen(filename) - 1] == '/' ? "" : "/";
+            snprintf(names[count], len, "%s%s%s", filename, sep, ent->d_name);
+            count++;
+        }
+        closedir(dir);
+        if (rc == 0) qsort(names, (size_t)count, sizeof(char *), compareNames);
+        for (int k = 0; k < count; k++) {
+            if (rc == 0) rc = collectFiles(names[k], jobs, 1);
+            free(names[k]);
+        }
+        free(names);
+        return rc;
     }
-    fclose(f);
+    if (fromDir) {
+        // only Markdown files are picked up from directories
+        size_t len = strlen(filename);
+        if (len < 3 || strcmp(filename + len - 3, ".md") != 0) return 0;
+        if (len >= 9 && strcmp(filename + len - 9, "-fixed.md") == 0) return 0;
+    }
+    if (reserve((void **)&jobs->jobs, &jobs->cap, jobs->count, sizeof(Job)) != 0) return -1;
+    char *name = malloc(strlen(filename) + 1);
+    if (!name) return -1;
+    strcpy(name, filename);
+    jobs->jobs[jobs->count++] = (Job){ name, { NULL, 0, 0 }, { NULL, 0, 0 }, 0, { 0 } };
+    return 0;
+}
 
-    int isCodeLine[lineCount];
-    markCodeBlocks(lines, lineCount, isCodeLine);
-
-    FullEntry fullEntries[MAX_ENTRIES];
-    // FullEntry *fullEntries = malloc(MAX_ENTRIES * sizeof(FullEntry));
-    int fullCount = 0;
-    InText inTexts[MAX_ENTRIES*2];
-    // InText *inTexts = malloc(MAX_ENTRIES * sizeof(InTexts));
-    int inCount = 0;
-
-    // Collect full-entry citations
-    // ----------------------------
-    for (int i = 0; i < lineCount; i++) {
-        if (strstr(lines[i], "]:") && !isCodeLine[i]) {
-            char *label = NULL;
-            const char *body;
-            if (findFullEntry(lines[i], &label, &body)) {
-                // check if label has length=0
-                if (strlen(label) == 0) {
-                    fprintf(stderr, "ERROR: [^%s] full-entry citation missing label (line %d)\n",
-                            label, i+1);
-                    cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-                    return 1;
-                }
-                // check if label contains any spaces
-                for (int k = 0; k < strlen(label); k++) {
-                    if (isspace(label[k])) {
-                        fprintf(stderr, "ERROR: [^%s] full-entry citation contains a space (line %d)\n",
-                                label, i+1);
-                        cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-                        return 1;
-                    }
-                }
-                // loop through current list of full-entries to check if duplicate
-                for (int j = 0; j < fullCount; j++) {
-                    if (strcmp(fullEntries[j].label, label) == 0) {
-                        // ONE duplicate allowed
-                        if (incrementDuplicates) {
-                            // first duplicate found
-                            if (dup_full_entry == NULL) {
-                                dup_full_entry = strdup(label);
-                                num_dup_full_entry = 2;
-                                // printf("First full-entry dupe found, line %d\n",
-                                //         i+1);
-                                // printf("num_dup_full_entry = %d\n",
-                                //         num_dup_full_entry);
-                            // first duplicate previously found already
-                            } else {
-                                // this duplicate is DIFFERENT from first duplicate found
-                                if (strcmp(label, dup_full_entry) != 0) {
-                                    fprintf(stderr,"ERROR: relaxed-duplicates (-d) mode allows only ONE full-entry duplicate (found: [^%s] and [^%s] duplicates)\n",
-                                            dup_full_entry, label);
-                                    cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-                                    return 1;
-                                // this duplicate is the SAME as first duplicate found
-                                } else {
-                                    num_dup_full_entry++;
-                                    // printf("Dupe found, line %d\n",
-                                    //         i+1);
-                                    // printf("num_dup_full_entry = %d\n",
-                                    //         num_dup_full_entry);
-                                    break;
-                                }
-                            }
-                        // NO duplicates allowed
-                        } else {
-                            fprintf(stderr,"ERROR: duplicate [^%s] full-entry citations (line %d and %d)\n",
-                                    label, fullEntries[j].lineIdx+1, i+1);
-                            printf("Help: Use the '-d' flag to relax duplicate handling. Run 'citeorder -h' for more info\n");
-                            cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-                            return 1;
-                        }
-                    }
-                }
+#ifdef HAVE_THREADS
+// Take the next job from a queue: the owner takes from the front so each worker
+// mostly runs its own files in order, thieves take from the back.
+static int takeJob(WorkQueue *q, int steal) {
+    int idx = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->lo < q->hi) idx = steal ? --q->hi : q->lo++;
+    pthread_mutex_unlock(&q->lock);
+    return idx;
+}
 
-                fullEntries[fullCount].label    = label;    // store strndup'd label
-                fullEntries[fullCount].lineIdx  = i;
-                fullEntries[fullCount].text     = lines[i];
-                fullEntries[fullCount].newNum   = 0;        // assign later
-                fullCount++;
-                
-                // printf("Line %d: New full_entry: {label: %s, line: %d, newNum: %d}\n",
-                //         i+1,
-                //         fullEntries[fullCount-1].label,
-                //         fullEntries[fullCount-1].lineIdx,
-                //         fullEntries[fullCount-1].newNum);
-            }
+static void *runWorker(void *arg) {
+    Worker *w = arg;
+    Pool *pool = w->pool;
+    citeorder_result res = { 0 };
+    for (;;) {
+        int idx = takeJob(&pool->queues[w->id], 0);
+        // own queue is empty: steal from the others, nearest first
+        for (int k = 1; idx < 0 && k < pool->nworkers; k++) {
+            idx = takeJob(&pool->queues[(w->id + k) % pool->nworkers], 1);
         }
+        // no job is ever added after the start, so empty queues mean we are done
+        if (idx < 0) break;
+        Job *job = &pool->jobs[idx];
+        job->status = processCached(job->filename, pool->opts, &res, &job->out, &job->err, &job->cached);
     }
-    // printf("FINISHED COLLECTING FULL-ENTRIES.\n");
-
-    // Collect in-text citations and assign sequential new numbers
-    // -----------------------------------------------------------
-    int nextNum = 1;
-    for (int i = 0; i < lineCount; i++){
-        if (strstr(lines[i], "]:") || isCodeLine[i]) continue; // skip full-entry lines or code blocks
-
-        const char *pos=NULL;
-        char *label = NULL;
-        
-        // recursively check lines[i] for in-text footnotes
-        while (findInText(lines[i], &pos, &label)){
-            // check if label has length<=0
-            if (strlen(label) == 0) {
-                fprintf(stderr, "ERROR: in-text citation [^%s] missing label (line %d)\n",
-                        label, i+1);
-                cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-                return 1;
-            }
-            // check if label contains any spaces
-            for (int k = 0; k < strlen(label); k++) {
-                if (isspace(label[k])) {
-                    fprintf(stderr, "ERROR: in-text citation [^%s] contains a space (line %d)\n",
-                            label, i+1);
-                    cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-                    return 1;
-                }
+    citeorder_result_free(&res);
+    return NULL;
+}
+#endif
+
+// Process every job, on up to nworkers threads. Each job gets an equal share
+// of the list up front; workers that run out steal from the others.
+static void runJobs(Job *jobs, int count, const Options *opts, int nworkers) {
+#ifdef HAVE_THREADS
+    if (nworkers > count) nworkers = count;
+    if (nworkers > 1) {
+        WorkQueue *queues = malloc((size_t)nworkers * sizeof(WorkQueue));
+        Worker *workers = malloc((size_t)nworkers * sizeof(Worker));
+        pthread_t *threads = malloc((size_t)nworkers * sizeof(pthread_t));
+        if (queues && workers && threads) {
+            Pool pool = { jobs, opts, queues, nworkers };
+            for (int w = 0; w < nworkers; w++) {
+                pthread_mutex_init(&queues[w].lock, NULL);
+                queues[w].lo = (int)((long long)count * w / nworkers);
+                queues[w].hi = (int)((long long)count * (w + 1) / nworkers);
+                workers[w] = (Worker){ &pool, w };
             }
-            // check if in-text matches duplicate full-entry
-            if (incrementDuplicates) {
-                if (strcmp(label, dup_full_entry) == 0) {
-                    num_dup_in_text++;
-                    // printf("num_dup_in_text = %d, line: %d\n",
-                    //         num_dup_in_text, i+1);
-                }
-                // check if number of duplicate in-texts > number of duplicate full-entries
-                if (num_dup_in_text > num_dup_full_entry) {
-                    fprintf(stderr,"ERROR: relaxed-duplicates (-d) mode expects EQUAL number of full-entry and in-text duplicates (found: %d [^%s] full-entries, %d [^%s] in-texts)\n",
-                            num_dup_full_entry, label, num_dup_in_text, label);
-                    cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-                    return 1;
-                }
+            // this thread is worker 0
+            int started = 1;
+            while (started < nworkers &&
+                   pthread_create(&threads[started], NULL, runWorker, &workers[started]) == 0) {
+                started++;
             }
-            // find the corresponding full entry
-            FullEntry *entry=NULL;
-            for (int j = 0; j < fullCount; j++) {
-                if(strcmp(fullEntries[j].label, label) == 0) {
-                    entry = &fullEntries[j];
-                    // skip if duplicates allowed and matched full-entry already assigned
-                    if (incrementDuplicates && entry->newNum != 0) {
-                        // printf("Full-entry on line %d already assigned\n",
-                        //         entry->lineIdx + 1);
-                        continue;
-                    } else {
-                        break;
-                    }
+            runWorker(&workers[0]);
+            for (int w = 1; w < started; w++) pthread_join(threads[w], NULL);
+            // a worker that failed to start leaves its queue to be stolen by the others
+            for (int w = 0; w < nworkers; w++) pthread_mutex_destroy(&queues[w].lock);
+            free(queues);
+            free(workers);
+            free(threads);
+            return;
+        }
+        free(queues);
+        free(workers);
+        free(threads);
+    }
+#else
+    (void)nworkers;
+#endif
+    citeorder_result res = { 0 };
+    for (int k = 0; k < count; k++) {
+        jobs[k].status = processCached(jobs[k].filename, opts, &res, &jobs[k].out, &jobs[k].err, &jobs[k].cached);
+    }
+    citeorder_result_free(&res);
+}
+
+// Print and clear the messages collected for one run over a file
+static void flushMessages(TextBuf *msgs, TextBuf *errs, FILE *out, FILE *err) {
+    if (msgs->len) fwrite(msgs->data, 1, msgs->len, out);
+    fflush(out);
+    if (errs->len) fwrite(errs->data, 1, errs->len, err);
+    fflush(err);
+    msgs->len = errs->len = 0;
+}
+
+// Process filename, then again every time it is saved, until interrupted.
+// The parsed document stays in memory, so a save only re-lexes the lines that
+// changed and renumbers from the first citation after them (the rest of the
+// update still scales with the document, see citeorder_doc_update()).
+static int watchFile(const char *filename, const Options *opts, FILE *out, FILE *err) {
+#ifdef HAVE_INOTIFY
+    // watch the directory, since editors often save by renaming a new file over the old one
+    char dir[MAX_PATH_LEN];
+    const char *base = strrchr(filename, '/');
+    if (base && (size_t)(base - filename) + 1 >= sizeof(dir)) {
+        fprintf(err, "inotify: %s\n", strerror(ENAMETOOLONG));
+        return 1;
+    }
+    if (base) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(base - filename) + 1, filename);
+        base++;
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+        base = filename;
+    }
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        fprintf(err, "inotify: %s\n", strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    citeorder_doc *doc = citeorder_doc_new(&opts->process);
+    if (!doc) {
+        fprintf(err, "malloc: %s\n", strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    TextBuf msgs = { NULL, 0, 0 }, errs = { NULL, 0, 0 };
+    int status = 0;
+    int changed = 1;
+    for (;;) {
+        if (changed) {
+            IoStats io = { 0, 0, 0 };
+            double tick = opts->process.stats ? now() : 0;
+            Source src;
+            if (loadSource(filename, &src) != 0) {
+                // between an editor's delete and rename; the next event brings it back
+                bufPrintf(&errs, "citeorder: file '%s' does not exist\n", filename);
+                status = 1;
+            } else {
+                citeorder_result res;
+                if (opts->process.stats) io.readTime = now() - tick;
+                citeorder_doc_update(doc, src.data, src.size, &res);
+                if (opts->process.stats) tick = now();
+                status = opts->process.report ? writeReported(filename, opts, &res, &msgs, &errs, &io.bytesWritten)
+                                              : writeFixed(filename, opts, &res, &msgs, &errs, &io.bytesWritten);
+                if (opts->process.stats) {
+                    io.writeTime = now() - tick;
+                    reportStats(filename, opts, &res, &io, &errs);
                 }
             }
-            if(!entry) {
-                fprintf(stderr,"ERROR: in-text citation [^%s] without full-entry (line %d)\n", label, i+1);
-                // cleanup
-                cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-                return 1;
-            }
-	        if (!relaxedQuotes) {
-                if(!hasProperQuoteContext(lines, i, pos)) {
-                    fprintf(stderr,"ERROR: in-text citation [^%s] not properly quoted (line %d)\n", label, i+1);
-                    printf("Help: Use the '-q' flag to relax quote handling. Run 'citeorder -h' for more info\n");
-                    // cleanup
-                    cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-                    return 1;
-		        }
-            }
+            freeSource(&src);
+            flushMessages(&msgs, &errs, out, err);
+        }
 
-            // assign matching full-entry the next number if not already assigned
-            if(entry->newNum == 0){
-                entry->newNum = nextNum++;
-            }
+        // wait for a save of this file; several events may come at once
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n = read(fd, events, sizeof(events));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            fprintf(err, "inotify: %s\n", n < 0 ? strerror(errno) : "closed");
+            break;
+        }
+        changed = 0;
+        for (char *p = events; p < events + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, base) == 0) changed = 1;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    citeorder_doc_free(doc);
+    free(msgs.data);
+    free(errs.data);
+    close(fd);
+    return status;
+#else
+    (void)filename;
+    (void)opts;
+    (void)out;
+    fprintf(err, "citeorder: --watch is not supported on this platform\n");
+    return 1;
+#endif
+}
 
-            inTexts[inCount].label      = label;
-            inTexts[inCount].newNum     = entry->newNum;
-            inTexts[inCount].lineIdx    = i;
-            inTexts[inCount].ref        = entry;
-            inCount++;
-            
-            // printf("Line %d: New in_text: {label: %s, line: %d, newNum: %d}\n",
-            //         i+1,
-            //         inTexts[inCount-1].label,
-            //         inTexts[inCount-1].lineIdx,
-            //         inTexts[inCount-1].newNum);
-            // printf("Matching full-entry: {label: %s, line: %d, newNum: %d}\n",
-            //         entry->label,
-            //         entry->lineIdx,
-            //         entry->newNum);
-        }
-    }
-    // printf("FINISHED COLLECTING IN-TEXTS.\n");
-    // check if number of duplicate in-texts < number of duplicate full-entries
-    if (num_dup_in_text < num_dup_full_entry) {
-        fprintf(stderr,"ERROR: relaxed-duplicates (-d) mode expects EQUAL number of full-entry and in-text duplicates (found: %d [^%s] full-entries, %d [^%s] in-texts)\n",
-                num_dup_full_entry, dup_full_entry, num_dup_in_text, dup_full_entry);
-        cleanup(lines, lineCount, fullEntries, inTexts, fullCount, inCount);
-        return 1;
+// Serve mode
+// ----------
+// With --serve, an editor keeps one process running and talks to it in JSON,
+// one object per line: requests on stdin (or from a file given as the only
+// input), each answered on stdout in turn. Open documents are kept parsed in
+// memory (a citeorder_doc each), so renumbering after an edit re-lexes only
+// the lines that changed (though it still scales with the document, see
+// citeorder_doc_update()). Offsets are in bytes of the document's text.
+//
+//   {"id":1,"method":"open","doc":"a.md","text":"..."}
+//   {"id":2,"method":"change","doc":"a.md","edits":[{"start":0,"end":3,"text":"..."}]}
+//   {"id":3,"method":"renumber","doc":"a.md"}
+//   {"id":4,"method":"close","doc":"a.md"}
+//
+// Each is answered {"id":...,"ok":true}, renumber with "changed" and "edits"
+// as well: the changes against the text before it, in order, which are applied
+// to the document kept here too. The edits of a change apply one after the
+// other. A request that fails is answered "ok":false with an "error", or, for a
+// document whose footnotes have one, its "status", "line", "message" and "hint".
+
+// A document open in serve mode
+typedef struct {
+    char *name;
+    char *text;
+    size_t len, cap;
+    citeorder_doc *doc;
+} ServedDoc;
+
+typedef struct {
+    ServedDoc *docs;   // sorted by name
+    int count, cap;
+} DocTable;
+
+// An edit to apply, as sent by the client
+typedef struct {
+    size_t start, end;
+    TextBuf text;
+} TextEdit;
+
+// A request, decoded
+typedef struct {
+    TextBuf id;        // the JSON of "id" as sent, echoed back
+    TextBuf method;
+    TextBuf doc;
+    TextBuf text;
+    int hasText;
+    TextEdit *edits;
+    int editCount, editCap;
+} Request;
+
+// A cursor over one line of JSON
+typedef struct {
+    const char *p, *end;
+} JsonIn;
+
+static void jsonSpace(JsonIn *in) {
+    while (in->p < in->end && (*in->p == ' ' || *in->p == '\t' || *in->p == '\r' || *in->p == '\n')) in->p++;
+}
+
+// skip c (after any space) if it comes next
+static bool jsonExpect(JsonIn *in, char c) {
+    jsonSpace(in);
+    if (in->p == in->end || *in->p != c) return false;
+    in->p++;
+    return true;
+}
+
+// the four hex digits of a \u escape, or -1
+static long jsonHex4(JsonIn *in) {
+    if (in->end - in->p < 4) return -1;
+    long v = 0;
+    for (int k = 0; k < 4; k++) {
+        char c = *in->p++;
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
     }
+    return v;
+}
 
-    // Unused fullEntries get bubbled to the top
-    // -----------------------------------------
-    int numUnusedFullEntry = 0;
-    for (int i = 0; i < fullCount; i++) {
-	    if (fullEntries[i].newNum == 0) {
-	        numUnusedFullEntry++;
-	    }
+// append code point cp as UTF-8
+static int bufUtf8(TextBuf *buf, unsigned long cp) {
+    char u[4];
+    size_t n;
+    if (cp < 0x80) {
+        u[0] = (char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        u[0] = (char)(0xC0 | cp >> 6);
+        u[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    } else if (cp < 0x10000) {
+        u[0] = (char)(0xE0 | cp >> 12);
+        u[1] = (char)(0x80 | (cp >> 6 & 0x3F));
+        u[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    } else {
+        u[0] = (char)(0xF0 | cp >> 18);
+        u[1] = (char)(0x80 | (cp >> 12 & 0x3F));
+        u[2] = (char)(0x80 | (cp >> 6 & 0x3F));
+        u[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
     }
-    int k = 1;
-    for (int j = 0; j < fullCount; j++) {
-        if (fullEntries[j].newNum == 0) {
-            fullEntries[j].newNum = fullCount - numUnusedFullEntry + k;
-	        k++;
+    return bufAppend(buf, u, n);
+}
+
+// Decode a JSON string into buf, replacing what it held. Returns 0, or -1 if
+// it is malformed or out of memory.
+static int jsonString(JsonIn *in, TextBuf *buf) {
+    buf->len = 0;
+    if (!jsonExpect(in, '"') || bufAppend(buf, "", 0) != 0) return -1;
+    for (;;) {
+        const char *run = in->p;
+        while (in->p < in->end && *in->p != '"' && *in->p != '\\' && (unsigned char)*in->p >= 0x20) in->p++;
+        if (bufAppend(buf, run, (size_t)(in->p - run)) != 0 || in->p == in->end) return -1;
+        if (*in->p == '"') {
+            in->p++;
+            return 0;
         }
+        if (*in->p != '\\' || in->end - in->p < 2) return -1;
+        char c = in->p[1];
+        in->p += 2;
+        long cp;
+        switch (c) {
+            case '"': case '\\': case '/': cp = c; break;
+            case 'b': cp = '\b'; break;
+            case 'f': cp = '\f'; break;
+            case 'n': cp = '\n'; break;
+            case 'r': cp = '\r'; break;
+            case 't': cp = '\t'; break;
+            case 'u':
+                cp = jsonHex4(in);
+                if (cp >= 0xD800 && cp < 0xDC00) {
+                    // a surrogate pair
+                    if (in->end - in->p < 2 || in->p[0] != '\\' || in->p[1] != 'u') return -1;
+                    in->p += 2;
+                    long low = jsonHex4(in);
+                    if (low < 0xDC00 || low >= 0xE000) return -1;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                if (cp < 0) return -1;
+                break;
+            default:
+                return -1;
+        }
+        if (bufUtf8(buf, (unsigned long)cp) != 0) return -1;
+    }
+}
+
+// a non-negative integer that fits a size_t
+static int jsonSize(JsonIn *in, size_t *v) {
+    jsonSpace(in);
+    if (in->p == in->end || *in->p < '0' || *in->p > '9') return -1;
+    *v = 0;
+    while (in->p < in->end && *in->p >= '0' && *in->p <= '9') {
+        if (*v > ((size_t)-1 - 9) / 10) return -1;
+        *v = *v * 10 + (size_t)(*in->p++ - '0');
+    }
+    return 0;
+}
+
+// Skip a JSON value of any kind. Returns 0, or -1 if it is malformed (or
+// nested too deeply).
+static int jsonSkip(JsonIn *in, int depth) {
+    jsonSpace(in);
+    if (in->p == in->end || depth > 64) return -1;
+    char c = *in->p;
+    if (c == '"') {
+        TextBuf scratch = { NULL, 0, 0 };
+        int rc = jsonString(in, &scratch);
+        free(scratch.data);
+        return rc;
+    }
+    if (c == '{' || c == '[') {
+        char close = c == '{' ? '}' : ']';
+        in->p++;
+        if (jsonExpect(in, close)) return 0;
+        do {
+            if (c == '{' && (jsonSkip(in, depth + 1) != 0 || !jsonExpect(in, ':'))) return -1;
+            if (jsonSkip(in, depth + 1) != 0) return -1;
+        } while (jsonExpect(in, ','));
+        return jsonExpect(in, close) ? 0 : -1;
     }
+    // a number, true, false or null
+    const char *from = in->p;
+    while (in->p < in->end && (isalnum((unsigned char)*in->p) || *in->p == '-' || *in->p == '+' || *in->p == '.')) in->p++;
+    return in->p > from ? 0 : -1;
+}
 
-    // Check if anything changed
-    // -------------------------
-    bool changed = false;
-    for (int i = 0; i < fullCount; i++) {
-        if (entryChanged(fullEntries[i].label, fullEntries[i].newNum)) {
-            changed = true;
+// [{"start":n,"end":n,"text":"..."},...] into req->edits
+static int jsonEdits(JsonIn *in, Request *req) {
+    if (!jsonExpect(in, '[')) return -1;
+    if (jsonExpect(in, ']')) return 0;
+    TextBuf key = { NULL, 0, 0 };
+    int rc = 0;
+    do {
+        if (reserve((void **)&req->edits, &req->editCap, req->editCount, sizeof(TextEdit)) != 0) {
+            rc = -1;
             break;
         }
-    }
-    for (int j = 0; j < inCount; j++) {
-        if (entryChanged(inTexts[j].label, inTexts[j].newNum)) {
-            changed = true;
+        TextEdit *e = &req->edits[req->editCount++];
+        memset(e, 0, sizeof(*e));
+        int fields = 0;
+        if (!jsonExpect(in, '{')) rc = -1;
+        while (rc == 0 && !jsonExpect(in, '}')) {
+            if (fields && !jsonExpect(in, ',')) rc = -1;
+            else if (jsonString(in, &key) != 0 || !jsonExpect(in, ':')) rc = -1;
+            else if (strcmp(key.data, "start") == 0) rc = jsonSize(in, &e->start), fields |= 1;
+            else if (strcmp(key.data, "end") == 0) rc = jsonSize(in, &e->end), fields |= 2;
+            else if (strcmp(key.data, "text") == 0) rc = jsonString(in, &e->text), fields |= 4;
+            else rc = jsonSkip(in, 1), fields |= 8;
+        }
+        if (rc == 0 && (fields & 3) != 3) rc = -1;
+    } while (rc == 0 && jsonExpect(in, ','));
+    if (rc == 0 && !jsonExpect(in, ']')) rc = -1;
+    free(key.data);
+    return rc;
+}
+
+// Decode one request line. Returns NULL, or what is wrong with it.
+static const char *parseRequest(const char *line, size_t len, Request *req) {
+    JsonIn in = { line, line + len };
+    TextBuf key = { NULL, 0, 0 };
+    int rc = jsonExpect(&in, '{') ? 0 : -1;
+    int first = 1;
+    while (rc == 0 && !jsonExpect(&in, '}')) {
+        if (!first && !jsonExpect(&in, ',')) {
+            rc = -1;
             break;
         }
+        first = 0;
+        if (jsonString(&in, &key) != 0 || !jsonExpect(&in, ':')) {
+            rc = -1;
+        } else if (strcmp(key.data, "id") == 0) {
+            jsonSpace(&in);
+            const char *from = in.p;
+            rc = jsonSkip(&in, 1);
+            req->id.len = 0;
+            if (rc == 0) rc = bufAppend(&req->id, from, (size_t)(in.p - from));
+        } else if (strcmp(key.data, "method") == 0) {
+            rc = jsonString(&in, &req->method);
+        } else if (strcmp(key.data, "doc") == 0) {
+            rc = jsonString(&in, &req->doc);
+        } else if (strcmp(key.data, "text") == 0) {
+            rc = jsonString(&in, &req->text);
+            req->hasText = 1;
+        } else if (strcmp(key.data, "edits") == 0) {
+            rc = jsonEdits(&in, req);
+        } else {
+            rc = jsonSkip(&in, 1);
+        }
     }
-    // printf("Ready for outputting...\n");
-    // Output to new file
-    // ------------------
-    if (changed) {
-        char outName[512];
-        char base[256];
-        strncpy(base, filename, sizeof(base));
-        base[sizeof(base)-1]='\0';
-        char *dot = strrchr(base, '.');
-        if(dot && strcmp(dot,".md")==0) *dot='\0';
-        snprintf(outName,sizeof(outName),"%s-fixed.md", base);
-        
-        FILE *out=fopen(outName,"w");
-        if(!out){ perror("fopen"); return 1; }
-        
-        // Update lines
-	    int i = 0;
-        int dup_count = 0;
-        while (i < lineCount){
-            // inside code block?
-            if (isCodeLine[i]) {
-           	    // char *lineCopy = strdup(lines[i]);
-                // fputs(lineCopy, out);
-                // free(lineCopy);
-                fputs(lines[i], out);
-                i++;
-                continue; 
-            } else if (!strstr(lines[i], "]:")) {
-    	    	// --- in-text line ---
-           	    char *lineCopy = strdup(lines[i]);
-           	    updateLineInTexts(lineCopy, inTexts, inCount, i);
-           	    fputs(lineCopy, out);
-           	    free(lineCopy);
-    		    i++;
-            } else {
-                // --- full entry line ---
-                // inside code block?
-                // if (isCodeLine[i]) {
-                //     fputs(lines[i], out);
-                //     i++;
-                //     continue; 
-                // }
-                const char *p = strstr(lines[i], "[^");
-                if (!p) {
-                    fputs(lines[i], out);
-                    i++;
-                    continue;
-                }
-                const char *q = strstr(p + 2, "]");
-                if (!q) {
-                    fputs(lines[i], out);
-                    i++;
-                    continue;
-                }
-                if (isInsideInlineCode(lines[i], p, q)) {
-                    fputs(lines[i], out);
-                    i++;
-                    continue;
-                }
+    free(key.data);
+    jsonSpace(&in);
+    if (rc != 0 || in.p != in.end) return "malformed request";
+    if (!req->method.data) return "missing method";
+    if (!req->doc.data) return "missing doc";
+    return NULL;
+}
 
-                int start = i;
-                int end = i;
-                char *label;
-                const char *body;
-                while (end < lineCount - 1 && findFullEntry(lines[end+1], &label, &body)) {
-                    end++;
-                }
-            
-                // Collect block entries
-                int blockSize = end - start + 1;
-                // printf("blockSize = %d\n", blockSize);
-                FullEntry **block = malloc(blockSize * sizeof(*block));
-                int k = 0;
-                int dup_skip = 0;
-                for (int j = start; j <= end; j++) {
-                    // find full-entry
-                    if (findFullEntry(lines[j], &label, &body)) {
-                        // find matching full-entry in fullEntries
-                        for (int fe = 0; fe < fullCount; fe++) {
-                            if (strcmp(fullEntries[fe].label, label) == 0) {
-                                if (incrementDuplicates && strcmp(label, dup_full_entry) == 0) {
-                                    if (dup_skip == 0) {
-                                        dup_count++;
-                                        dup_skip = dup_count - 1;
-                                    } else {
-                                        dup_skip--;
-                                    }
-                                }
-                                if (!incrementDuplicates || dup_skip == 0) {
-                                    block[k++] = &fullEntries[fe];
-                                    break;
-                                }
-                            }
-                        }
-                        free(label);
-                    }
-                }
-            
-                // Sort block by newNum
-                for (int a = 0; a < k - 1; a++) {
-                    for (int b = a + 1; b < k; b++) {
-                        if (block[a]->newNum > block[b]->newNum) {
-                            FullEntry *tmp = block[a];
-                            block[a] = block[b];
-                            block[b] = tmp;
-                        }
-                    }
-                }
-            
-                // Print block in order
-                for (int a = 0; a < k; a++) {
-                    const FullEntry *fe = block[a];
-            
-                    // Construct updated line
-                    const char *orig = fe->text;
-                    const char *colon = strchr(orig, ':');  // should always exist
-                    if (!colon) continue;
-            
-                    char newMarker[32];
-                    snprintf(newMarker, sizeof(newMarker), "[^%d]:", fe->newNum);
-            
-                    // add leading spaces
-                    int piv=0;
-                    while (isspace((unsigned char)*(orig+piv))) {
-                        piv++;
-                        fputs(" ", out);
-                    }
-
-                    // Print new marker + remainder of original line (after the ':')
-                    fputs(newMarker, out);
-                    fputs(colon + 1, out);
-            
-                    // Ensure newline
-                    size_t len = strlen(orig);
-                    if (len == 0 || orig[len - 1] != '\n') {
-                        fputc('\n', out);
-                    }
-                }
-            
-                free(block);
-                i = end + 1;
-            }
+static void freeRequest(Request *req) {
+    free(req->id.data);
+    free(req->method.data);
+    free(req->doc.data);
+    free(req->text.data);
+    for (int k = 0; k < req->editCount; k++) free(req->edits[k].text.data);
+    free(req->edits);
+    memset(req, 0, sizeof(*req));
+}
+
+// the first document whose name is not before name
+static int docIndex(const DocTable *t, const char *name) {
+    int lo = 0, hi = t->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(t->docs[mid].name, name) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static ServedDoc *findDoc(const DocTable *t, const char *name) {
+    int k = docIndex(t, name);
+    return k < t->count && strcmp(t->docs[k].name, name) == 0 ? &t->docs[k] : NULL;
+}
+
+// The open document called name, added (empty) if there is none. NULL if out of memory.
+static ServedDoc *openDoc(DocTable *t, const char *name, const citeorder_opts *opts) {
+    int k = docIndex(t, name);
+    if (k < t->count && strcmp(t->docs[k].name, name) == 0) return &t->docs[k];
+    if (reserve((void **)&t->docs, &t->cap, t->count, sizeof(ServedDoc)) != 0) return NULL;
+    ServedDoc d = { strdup(name), NULL, 0, 0, citeorder_doc_new(opts) };
+    if (!d.name || !d.doc) {
+        free(d.name);
+        citeorder_doc_free(d.doc);
+        return NULL;
+    }
+    memmove(&t->docs[k + 1], &t->docs[k], (size_t)(t->count - k) * sizeof(ServedDoc));
+    t->docs[k] = d;
+    t->count++;
+    return &t->docs[k];
+}
+
+static void closeDoc(DocTable *t, ServedDoc *d) {
+    int k = (int)(d - t->docs);
+    free(d->name);
+    free(d->text);
+    citeorder_doc_free(d->doc);
+    memmove(&t->docs[k], &t->docs[k + 1], (size_t)(t->count - k - 1) * sizeof(ServedDoc));
+    t->count--;
+}
+
+// make room for len bytes of text. Returns 0, or -1 if out of memory.
+static int reserveText(ServedDoc *d, size_t len) {
+    if (len <= d->cap && d->text) return 0;
+    size_t cap = d->cap ? d->cap : 4096;
+    while (cap < len) cap *= 2;
+    char *grown = realloc(d->text, cap);
+    if (!grown) return -1;
+    d->text = grown;
+    d->cap = cap;
+    return 0;
+}
+
+// Apply the edits of a change in turn, or none of them if one does not fit.
+// Returns NULL, or what is wrong.
+static const char *applyEdits(ServedDoc *d, const TextEdit *edits, int count) {
+    size_t len = d->len, most = d->len;
+    for (int k = 0; k < count; k++) {
+        const TextEdit *e = &edits[k];
+        if (e->start > e->end || e->end > len) return "edit out of range";
+        len = len - (e->end - e->start) + e->text.len;
+        if (len > most) most = len;
+    }
+    if (reserveText(d, most) != 0) return "out of memory";
+    for (int k = 0; k < count; k++) {
+        const TextEdit *e = &edits[k];
+        memmove(d->text + e->start + e->text.len, d->text + e->end, d->len - e->end);
+        if (e->text.len) memcpy(d->text + e->start, e->text.data, e->text.len);
+        d->len = d->len - (e->end - e->start) + e->text.len;
+    }
+    return NULL;
+}
+
+// renumber: answer the edits that renumber d, and apply them to it
+static void renumberDoc(ServedDoc *d, TextBuf *resp) {
+    citeorder_result res;
+    citeorder_doc_update(d->doc, d->text ? d->text : "", d->len, &res);
+    if (res.status != CITEORDER_OK) {
+        bufPrintf(resp, ",\"ok\":false,\"status\":\"%s\"", citeorder_status_name(res.status));
+        if (res.line > 0) bufPrintf(resp, ",\"line\":%d", res.line);
+        bufAppend(resp, ",\"message\":", 11);
+        bufJsonString(resp, res.message ? res.message : "out of memory");
+        if (res.hint) {
+            bufAppend(resp, ",\"hint\":", 8);
+            bufJsonString(resp, res.hint);
         }
-        fclose(out);
-	    printf("Output written to %s\n", outName);
+        return;
+    }
+    const citeorder_edit *edits;
+    int count = citeorder_result_edits(&res, &edits);
+    size_t len;
+    const char *text = res.changed ? citeorder_result_text(&res, &len) : NULL;
+    if (count < 0 || (res.changed && (!text || reserveText(d, len) != 0))) {
+        bufAppend(resp, ",\"ok\":false,\"error\":\"out of memory\"", 35);
+        return;
+    }
+    bufPrintf(resp, ",\"ok\":true,\"changed\":%s,\"edits\":[", res.changed ? "true" : "false");
+    for (int k = 0; k < count; k++) {
+        bufPrintf(resp, "%s{\"start\":%llu,\"end\":%llu,\"text\":", k ? "," : "",
+                  (unsigned long long)edits[k].start, (unsigned long long)edits[k].end);
+        bufJsonBytes(resp, edits[k].text, edits[k].len);
+        bufAppend(resp, "}", 1);
+    }
+    bufAppend(resp, "]", 1);
+    if (res.changed) {
+        memcpy(d->text, text, len);
+        d->len = len;
+    }
+}
+
+// Answer one decoded request into resp
+static void serveRequest(DocTable *docs, const citeorder_opts *opts, Request *req, TextBuf *resp) {
+    const char *method = req->method.data;
+    const char *error = NULL;
+    ServedDoc *d = findDoc(docs, req->doc.data);
+    if (strcmp(method, "open") == 0) {
+        if (!req->hasText) {
+            error = "missing text";
+        } else if (!(d = openDoc(docs, req->doc.data, opts)) || reserveText(d, req->text.len) != 0) {
+            error = "out of memory";
+        } else {
+            // reopening keeps the parsed document, which the new text is compared against
+            if (req->text.len) memcpy(d->text, req->text.data, req->text.len);
+            d->len = req->text.len;
+        }
+    } else if (!d) {
+        error = "document is not open";
+    } else if (strcmp(method, "change") == 0) {
+        error = applyEdits(d, req->edits, req->editCount);
+    } else if (strcmp(method, "renumber") == 0) {
+        renumberDoc(d, resp);
+        bufAppend(resp, "}\n", 2);
+        return;
+    } else if (strcmp(method, "close") == 0) {
+        closeDoc(docs, d);
+    } else {
+        error = "unknown method";
+    }
+    if (error) {
+        bufAppend(resp, ",\"ok\":false,\"error\":", 20);
+        bufJsonString(resp, error);
     } else {
-	    printf("No changes required.\n");
+        bufAppend(resp, ",\"ok\":true", 10);
     }
+    bufAppend(resp, "}\n", 2);
+}
+
+// Read a line (without its newline) into line. Returns 0, or -1 at the end
+// of the input or if out of memory.
+static int readLine(FILE *in, TextBuf *line) {
+    char chunk[65536];
+    line->len = 0;
+    int got = 0;
+    while (fgets(chunk, sizeof(chunk), in)) {
+        size_t n = strlen(chunk);
+        got = 1;
+        int ended = n > 0 && chunk[n - 1] == '\n';
+        if (bufAppend(line, chunk, ended ? n - 1 : n) != 0) return -1;
+        if (ended) break;
+    }
+    if (!got) return -1;
+    if (line->len && line->data[line->len - 1] == '\r') line->data[--line->len] = '\0';
     return 0;
 }
+
+// --serve: answer requests from in until it ends. Returns the exit status.
+static int runServer(FILE *in, const Options *opts, FILE *out, FILE *err) {
+    citeorder_opts process = opts->process;
+    process.diff = 1; // the edits come from the rewritten lines, as a diff's do
+    DocTable docs = { NULL, 0, 0 };
+    TextBuf line = { NULL, 0, 0 }, resp = { NULL, 0, 0 };
+    while (readLine(in, &line) == 0) {
+        if (line.len == 0) continue;
+        Request req;
+        memset(&req, 0, sizeof(req));
+        const char *error = parseRequest(line.data, line.len, &req);
+        resp.len = 0;
+        bufAppend(&resp, "{\"id\":", 6);
+        if (req.id.len) bufAppend(&resp, req.id.data, req.id.len);
+        else bufAppend(&resp, "null", 4);
+        if (error) {
+            bufAppend(&resp, ",\"ok\":false,\"error\":", 20);
+            bufJsonString(&resp, error);
+            bufAppend(&resp, "}\n", 2);
+        } else {
+            serveRequest(&docs, &process, &req, &resp);
+        }
+        freeRequest(&req);
+        fwrite(resp.data, 1, resp.len, out);
+        fflush(out);
+    }
+    int status = 0;
+    if (ferror(in)) {
+        fprintf(err, "read: %s\n", strerror(errno));
+        status = 1;
+    }
+    while (docs.count) closeDoc(&docs, &docs.docs[docs.count - 1]);
+    free(docs.docs);
+    free(line.data);
+    free(resp.data);
+    return status;
+}
+
+// The command line, with what it would print to stdout and stderr written to
+// out and err instead, so that it can also be run in-process (test_citeorder
+// builds this file with CITEORDER_NO_MAIN). Returns the exit status.
+int citeorder_cli(int argc, char **argv, FILE *out, FILE *err) {
+    Options opts = { { 0, 0, 0, 0, 0, 0, 0 }, 0, 0, 0, 0, 0, 0, NULL, out };
+    const char *cachePath = NULL;
+    Cache cache = { NULL, 0, 0 };
+    int nworkers = 1;
+    JobList jobs = { NULL, 0, 0 };
+    int status = 0;
+
+    if (argc < 2) { 
+	    fprintf(out, "citeorder: missing operand\nUsage: 'citeorder [options] input.md'\nHelp: 'citeorder [-h|--help]'\n");
+	    return 1;
+    }
+
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_help(out);
+            return 0;
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--version") == 0) {
+            print_version(out);
+            return 0;
+        } else if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--relaxed-quotes") == 0) {
+	        opts.process.relaxed_quotes = 1;
+        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--relaxed-duplicates") == 0) {
+            opts.process.relaxed_duplicates = 1;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--stream") == 0) {
+            opts.stream = 1;
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--check") == 0) {
+            opts.process.check = 1;
+        } else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--watch") == 0) {
+            opts.watch = 1;
+        } else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--in-place") == 0) {
+            opts.inPlace = 1;
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            opts.serve = 1;
+        } else if (strcmp(argv[i], "--diff") == 0) {
+            opts.process.diff = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            opts.process.stats = 1;
+            opts.statsJson = 0;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            opts.process.stats = 1;
+            opts.statsJson = 1;
+        } else if (strcmp(argv[i], "--report") == 0 || strcmp(argv[i], "--report=json") == 0) {
+            opts.process.report = 1;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            cachePath = ".citeorder-cache";
+        } else if (strncmp(argv[i], "--cache=", 8) == 0 && argv[i][8]) {
+            cachePath = argv[i] + 8;
+        } else if (strncmp(argv[i], "-j", 2) == 0 || strcmp(argv[i], "--jobs") == 0) {
+            const char *n = argv[i][1] == 'j' && argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : "");
+            char *end;
+            long v = strtol(n, &end, 10);
+            if (*n == '\0' || *end != '\0' || v < 1 || v > 1024) {
+                fprintf(err, "citeorder: invalid number of jobs '%s'\nHelp: 'citeorder [-h|--help]'\n", n);
+                return 1;
+            }
+            nworkers = (int)v;
+	    } else if (collectFiles(argv[i], &jobs, 0) != 0) {
+            fprintf(err, "citeorder: cannot read '%s'\n", argv[i]);
+            status = 1;
+	    }
+    }
+    if (opts.serve && status == 0) {
+        // requests come from standard input, or from a file given to replay them
+        FILE *in = stdin;
+        if (jobs.count > 1 || opts.stream || opts.process.check || opts.watch || opts.inPlace ||
+            opts.process.diff || opts.process.report || opts.process.stats || cachePath) {
+            fprintf(err, "citeorder: --serve takes at most one input and cannot be combined with -s, -c, -w, -i, --diff, --report, --stats or --cache\n");
+            status = 1;
+        } else if (jobs.count == 1 && strcmp(jobs.jobs[0].filename, "-") != 0 &&
+                   (in = fopen(jobs.jobs[0].filename, "r")) == NULL) {
+            fprintf(err, "citeorder: cannot read '%s': %s\n", jobs.jobs[0].filename, strerror(errno));
+            status = 1;
+        } else {
+            status = runServer(in, &opts, out, err);
+            if (in != stdin) fclose(in);
+        }
+        for (int k = 0; k < jobs.count; k++) free(jobs.jobs[k].filename);
+        free(jobs.jobs);
+        return status;
+    }
+    if (jobs.count == 0 && status == 0) {
+	    fprintf(out, "citeorder: missing operand\nUsage: 'citeorder [options] input.md'\nHelp: 'citeorder [-h|--help]'\n");
+	    return 1;
+    }
+
+    // the document read from standard input is written to standard output
+    bool fromStdin = false;
+    for (int k = 0; k < jobs.count; k++) {
+        if (strcmp(jobs.jobs[k].filename, "-") == 0) fromStdin = true;
+    }
+    if (fromStdin && jobs.count > 1) {
+        fprintf(err, "citeorder: '-' (standard input) cannot be combined with other inputs\n");
+        for (int k = 0; k < jobs.count; k++) free(jobs.jobs[k].filename);
+        free(jobs.jobs);
+        return 1;
+    }
+    bool conflict = false;
+    if (opts.process.diff && (fromStdin || opts.stream || opts.process.check)) {
+        fprintf(err, "citeorder: --diff cannot be combined with -s, -c or '-'\n");
+        conflict = true;
+    } else if (opts.inPlace && (fromStdin || opts.process.check || opts.process.diff)) {
+        fprintf(err, "citeorder: --in-place cannot be combined with -c, --diff or '-'\n");
+        conflict = true;
+    } else if (cachePath && (fromStdin || opts.process.diff || opts.watch)) {
+        fprintf(err, "citeorder: --cache cannot be combined with --diff, -w or '-'\n");
+        conflict = true;
+    } else if (opts.process.report && (fromStdin || opts.stream || opts.process.check || opts.process.diff || cachePath)) {
+        fprintf(err, "citeorder: --report cannot be combined with -s, -c, --diff, --cache or '-'\n");
+        conflict = true;
+    }
+    if (conflict) {
+        for (int k = 0; k < jobs.count; k++) free(jobs.jobs[k].filename);
+        free(jobs.jobs);
+        return 1;
+    }
+    if (opts.watch) {
+        if (jobs.count != 1 || fromStdin || opts.stream) {
+            fprintf(err, "citeorder: --watch takes a single file and cannot be combined with -s\n");
+            status = 1;
+        } else {
+            status = watchFile(jobs.jobs[0].filename, &opts, out, err);
+        }
+        for (int k = 0; k < jobs.count; k++) free(jobs.jobs[k].filename);
+        free(jobs.jobs);
+        return status;
+    }
+    opts.batch = jobs.count > 1;
+    // a single file is split across the threads instead
+    if (jobs.count == 1) opts.process.threads = nworkers;
+    if (cachePath) {
+        if (loadCache(cachePath, &cache) != 0) {
+            fprintf(err, "citeorder: cannot read cache '%s': %s\n", cachePath, strerror(ENOMEM));
+            freeCache(&cache);
+            cachePath = NULL;
+        } else {
+            opts.cache = &cache;
+        }
+    }
+    runJobs(jobs.jobs, jobs.count, &opts, nworkers);
+    // a cache that cannot be updated only costs the next run its time
+    if (cachePath && saveCache(cachePath, jobs.jobs, jobs.count) != 0) {
+        fprintf(err, "citeorder: cannot update cache '%s': %s\n", cachePath, strerror(errno));
+    }
+    freeCache(&cache);
+
+    // Report in the order the files were given, whichever finished first
+    for (int k = 0; k < jobs.count; k++) {
+        Job *job = &jobs.jobs[k];
+        if (job->out.len) fwrite(job->out.data, 1, job->out.len, out);
+        fflush(out);
+        if (job->err.len) fwrite(job->err.data, 1, job->err.len, err);
+        // an error outranks a file that --check found out of order
+        if (status != 1 && (job->status == 1 || job->status > status)) status = job->status;
+        free(job->out.data);
+        free(job->err.data);
+        free(job->filename);
+        freeCacheEntry(&job->cached);
+    }
+    free(jobs.jobs);
+    return status;
+}
+
+#ifndef CITEORDER_NO_MAIN
+int main(int argc, char **argv) {
+    return citeorder_cli(argc, argv, stdout, stderr);
+}
+#endif
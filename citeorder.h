@@ -0,0 +1,160 @@
+// libciteorder: reorder Markdown footnotes in memory
+//
+// citeorder_process() takes a document as a buffer and returns the renumbered
+// document plus a structured status, without touching the filesystem. Calls
+// share no state, so any number of documents can be processed concurrently
+// from different threads, each with its own result.
+#ifndef CITEORDER_H
+#define CITEORDER_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    CITEORDER_OK = 0,
+    CITEORDER_ERR_MISSING_LABEL,       // [^] with no label
+    CITEORDER_ERR_LABEL_SPACE,         // a label containing a space
+    CITEORDER_ERR_DUPLICATE,           // two full entries with the same label
+    CITEORDER_ERR_MULTIPLE_DUPLICATES, // relaxed duplicates: more than one label duplicated
+    CITEORDER_ERR_UNEQUAL_DUPLICATES,  // relaxed duplicates: full-entry and in-text counts differ
+    CITEORDER_ERR_MISSING_ENTRY,       // an in-text citation without a full entry
+    CITEORDER_ERR_QUOTE,               // an in-text citation not properly quoted
+    CITEORDER_ERR_NO_MEMORY,
+    CITEORDER_ERR_IO                   // reading or writing a stream failed
+} citeorder_status;
+
+typedef struct {
+    int relaxed_quotes;      // -q: do not require quotes before in-text citations
+    int relaxed_duplicates;  // -d: number one duplicated label in order of use
+    int check;               // --check: only find out whether anything would be renumbered,
+                             // stopping at the first label that would be (no output is built)
+    int diff;                // --diff: remember where each rewritten line went, for citeorder_result_diff()
+    int stats;               // --stats: time each phase and count what was found, in result->stats
+    int threads;             // split a large document across up to this many threads
+                             // (citeorder_process() only, where threads are available; 0 or 1: none)
+    int report;              // --report: remember where each footnote was and its new number,
+                             // for citeorder_result_report() (citeorder_stream() reports the status only)
+} citeorder_opts;
+
+// Where processing a document spent its time and what it found (with opts->stats).
+// citeorder_stream() lexes as it reads, in the pass that needs the tokens, and
+// writes as it renders; a resident document's update counts re-indexing as lexing.
+typedef struct {
+    double index_time;       // seconds splitting the input into lines
+    double lex_time;         // finding footnotes, stacks and code
+    double full_entry_time;  // collecting full entries
+    double in_text_time;     // collecting in-text citations and checking their quotes
+    double number_time;      // numbering unused full entries and the final checks
+    double render_time;      // building the renumbered document
+    long lines;
+    long full_entries;
+    long in_texts;
+    long stacks;             // runs of adjacent in-text citations
+    long quote_backtracks;   // earlier lines (or parts of the line) scanned again for the mark before a closing quote
+    size_t bytes_in;
+    size_t bytes_out;        // the renumbered document, 0 if none was built
+} citeorder_stats;
+
+// The renumbered document, opaque; see citeorder_result_text/_write
+typedef struct citeorder_output citeorder_output;
+typedef struct citeorder_report citeorder_report;
+typedef struct citeorder_arena citeorder_arena;
+
+typedef struct {
+    citeorder_status status;
+    int line;                // 1-based line the error (with check, the first label out of order) was found on, 0 if none
+    char *message;           // what went wrong, NULL on success
+    const char *hint;        // how to get past the error (a command-line flag), or NULL
+    int changed;             // the footnotes were renumbered
+    citeorder_output *output;
+    citeorder_report *report; // with opts->report, the footnotes found; see citeorder_result_report()
+    citeorder_arena *arena;  // all memory of the result, reused by the next call
+    citeorder_stats stats;   // zero unless opts->stats
+} citeorder_result;
+
+// Renumber the footnotes of the len bytes at in. Returns result->status.
+// The output refers back into in, which must outlive the result.
+// result must be zero-initialised before its first use. Passing it again for
+// the next document reuses its memory in O(1), without freeing anything, and
+// invalidates the previous output; citeorder_result_free() releases it.
+int citeorder_process(const char *in, size_t len, const citeorder_opts *opts, citeorder_result *result);
+
+// The renumbered document as one buffer (NUL-terminated, len excludes the NUL),
+// or NULL if processing failed.
+const char *citeorder_result_text(citeorder_result *result, size_t *len);
+
+// Write the renumbered document to f without first joining it into one buffer.
+// Any stdio stream will do: one with a file descriptor is flushed and written
+// with writev(), one without (open_memstream(), fmemopen()) with fwrite().
+// Returns 0, or -1 with errno set.
+int citeorder_result_write(const citeorder_result *result, FILE *f);
+
+// The changes as a unified diff of name (a/name against b/name, with three
+// lines of context), or "" if nothing changed. Needs opts->diff; the hunks come
+// from the lines the renumbering rewrote, without comparing whole documents.
+// NULL if processing failed.
+const char *citeorder_result_diff(citeorder_result *result, const char *name, size_t *len);
+
+// One change to the input: [start, end) of it is replaced by the len bytes at text
+typedef struct {
+    size_t start;
+    size_t end;
+    const char *text;
+    size_t len;
+} citeorder_edit;
+
+// The changes as edits of the input, in order and not overlapping, each
+// covering only the bytes that differ within a rewritten line. Sets *edits
+// and returns how many there are (0 if nothing changed), or -1 if processing
+// failed or out of memory. Needs opts->diff, as citeorder_result_diff() does.
+int citeorder_result_edits(citeorder_result *result, const citeorder_edit **edits);
+
+// A short name for status, e.g. "missing_entry" ("ok" for CITEORDER_OK)
+const char *citeorder_status_name(citeorder_status status);
+
+// The outcome for name as one line of JSON: its status, and the error if there
+// was one, or else every full entry and in-text citation with its label, the
+// number it was given, and its 1-based line and byte column in the input.
+// NULL without opts->report, or if out of memory.
+const char *citeorder_result_report(citeorder_result *result, const char *name, size_t *len);
+
+void citeorder_result_free(citeorder_result *result);
+
+// Called once the footnotes are collected to get the stream to write to (any
+// stream, as for citeorder_result_write()), or NULL to stop there (e.g. when
+// result->changed is 0). The stream is not closed.
+typedef FILE *(*citeorder_open_fn)(void *ctx, const citeorder_result *result);
+
+// Like citeorder_process() (including the reuse of result), but in bounded
+// memory for inputs too large to hold: in (which must be seekable) is read
+// several times, a buffer of lines at a time, and only the per-label state is
+// kept. If nothing changed and a stream is still returned by open_output, the
+// document is copied through unchanged.
+int citeorder_stream(FILE *in, const citeorder_opts *opts,
+                     citeorder_open_fn open_output, void *ctx, citeorder_result *result);
+
+// A document kept in memory between edits, e.g. for watch mode
+typedef struct citeorder_doc citeorder_doc;
+
+citeorder_doc *citeorder_doc_new(const citeorder_opts *opts);
+
+// Like citeorder_process() for the document's new text (copied from in): only
+// the lines that differ from the previous text are re-lexed, and numbering
+// resumes from the first citation after them. An update still takes time in
+// proportion to the document, not the edit: the text and the parsed state are
+// copied, the citations from the edit on collected again, and a changed
+// document rendered in full. The result's memory belongs to doc, so result
+// need not be initialised or freed; its output is valid until the next update.
+int citeorder_doc_update(citeorder_doc *doc, const char *in, size_t len, citeorder_result *result);
+
+void citeorder_doc_free(citeorder_doc *doc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,3126 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+#include "citeorder.h"
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <unistd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#define HAVE_WRITEV
+#define HAVE_THREADS
+#endif
+
+// A line is a view into the source buffer, including its trailing '\n' (if any)
+typedef struct {
+    const char *text;
+    size_t len;
+} Line;
+
+// Index of the lines of a document
+typedef struct {
+    Line *lines;
+    int count;
+    int cap;
+} LineIndex;
+
+// Per-document bump arena. Everything the library allocates while processing
+// a document comes from here and is released at once: resetting keeps the
+// blocks for the next document, so a warm result processes without malloc.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t cap;
+    size_t used;
+    _Alignas(16) char data[];
+} ArenaBlock;
+
+typedef struct citeorder_arena {
+    ArenaBlock *head;
+    ArenaBlock *cur;     // block allocations are made from; later blocks are free
+    struct citeorder_arena *workers; // one per thread a document is split across (see processChunks)
+    int workerCount;
+} Arena;
+
+// Token stream produced by a single lexer pass over the document.
+// Tokens are in line order; offsets are bytes within the token's line.
+typedef enum {
+    TOK_FENCE,       // ``` line opening or closing a fenced code block
+    TOK_CODE_SPAN,   // `inline code` (or ``code``) on an in-text line
+    TOK_STACK,       // two or more in-text citations with nothing in between, followed by their TOK_CITEs
+    TOK_CITE,        // in-text citation [^label]
+    TOK_DEF          // full-entry definition [^label]: at the start of a line
+} TokenType;
+
+typedef struct {
+    unsigned char type;
+    int line;
+    unsigned start, end;   // end is exclusive, for TOK_DEF it is just past "]:"
+    unsigned label;        // offset of the (trimmed) label, TOK_CITE and TOK_DEF
+    unsigned labelLen;     // label length, or number of citations for TOK_STACK
+} Token;
+
+typedef struct {
+    Token *toks;
+    int count;
+    int cap;
+    Arena *arena;
+} TokenStream;
+
+typedef struct {
+    const char *label; // view into the source buffer
+    int labelLen;
+    int labelNum;    // the label's value if it is a number as written (see labelNumber()), else -1
+    int newNum;
+    int lineIdx;
+    int nextSame;    // index of the next full entry with the same label, or -1
+} FullEntry;
+
+// In-text citations in order of appearance, one array per field: once they
+// are collected, each pass reads only the field it needs
+typedef struct {
+    int *line;
+    int *newNum;     // number of the full entry each matched
+    int *writeNum;   // number written back in place of its label
+    int count;
+    int cap;
+} CiteTable;
+
+// Open-addressing hash index from a label to the full entries carrying it.
+// Duplicate labels (relaxed-duplicates mode) are chained through nextSame.
+typedef struct {
+    unsigned hash;
+    int id;          // the label interned: labels are numbered 0, 1, ... as first defined
+    int head;        // first full entry with this label, -1 if slot is empty
+    int last;        // last full entry with this label
+    int cursor;      // first entry in the chain not yet given a number
+    int lastLine;    // last line an in-text citation with this label was on
+    int lastLineNum; // number written for the label on that line
+} LabelSlot;
+
+typedef struct {
+    LabelSlot *slots;
+    int cap;         // always a power of two
+    int count;
+    Arena *arena;
+} LabelIndex;
+
+// Output is built as a list of segments, each either a span of the source
+// buffer (unchanged text) or a piece of replacement text, and flushed at once
+typedef struct {
+    const char *src; // span of the source buffer, or NULL for replacement text
+    size_t off;      // offset into Output.text when src is NULL
+    size_t len;
+} Segment;
+
+// Where a line that may have changed ended up in the output (with opts->diff):
+// from offset off of segment seg up to offset endOff of segment endSeg
+typedef struct {
+    int line;        // the input line
+    int seg, endSeg;
+    size_t off, endOff;
+} LineSpan;
+
+typedef struct citeorder_output {
+    Segment *segs;
+    int count;
+    int cap;
+    char *text;      // replacement text (new citation numbers, padding)
+    size_t textLen;
+    size_t textCap;
+    int failed;      // an allocation failed, the output is incomplete
+    Arena *arena;
+    char *joined;    // the whole document in one buffer, made on request
+    size_t joinedLen;
+    LineSpan *spans; // diff only: the rewritten lines, in order
+    int spanCount, spanCap;
+    const Line *lines; // diff only: the input lines
+    int lineCount;
+} Output;
+
+// Where a footnote was and the number it was given (with opts->report)
+typedef struct {
+    const char *label; // view into the source buffer
+    int labelLen;
+    int line;        // 1-based, as reported
+    int column;
+    int num;
+} ReportRow;
+
+typedef struct citeorder_report {
+    ReportRow *defs;  // the full entries, in order (none unless processing succeeded)
+    int defCount;
+    ReportRow *cites; // the in-text citations, in order
+    int citeCount;
+    Arena *arena;     // where the report is built, also for citeorder_doc results
+} Report;
+
+// find the first occurrence of the two characters "ab" in [s, end)
+static const char *findPair(const char *s, const char *end, char a, char b) {
+    while (end - s >= 2) {
+        const char *p = memchr(s, a, (size_t)(end - s - 1));
+        if (!p) return NULL;
+        if (p[1] == b) return p;
+        s = p + 1;
+    }
+    return NULL;
+}
+
+// Byte scanning
+// -------------
+// Lexing and the quote checks spend most of their time looking for a few
+// bytes ("[^", "]:", "``", '"' and ']') in long runs of prose. On x86 they
+// are found 16 (SSE2) or 32 (AVX2) bytes at a time, whichever the CPU has,
+// decided once at load time; elsewhere the scalar versions are used.
+typedef struct {
+    // first and last '"' or ']' in [s, end), the bytes a quote mark can be
+    const char *(*findMark)(const char *s, const char *end);
+    const char *(*findMarkBack)(const char *s, const char *end);
+    // first "[^", "``" or "]:" in [s, end): every token starts at one
+    const char *(*findToken)(const char *s, const char *end);
+} Scanner;
+
+static const char *findMarkScalar(const char *s, const char *end) {
+    for (; s < end; s++) {
+        if (*s == '"' || *s == ']') return s;
+    }
+    return NULL;
+}
+
+static const char *findMarkBackScalar(const char *s, const char *end) {
+    while (end > s) {
+        end--;
+        if (*end == '"' || *end == ']') return end;
+    }
+    return NULL;
+}
+
+static const char *findTokenScalar(const char *s, const char *end) {
+    for (; end - s >= 2; s++) {
+        if ((s[0] == '[' && s[1] == '^') || (s[0] == '`' && s[1] == '`') || (s[0] == ']' && s[1] == ':')) return s;
+    }
+    return NULL;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define HAVE_SIMD
+
+// The vector versions never read outside [s, end): a range that is not a
+// whole number of vectors ends with one that overlaps the previous one, and
+// ranges shorter than a vector go to the narrower version.
+
+static inline unsigned markMaskSSE2(const char *p) {
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+                                                    _mm_cmpeq_epi8(x, _mm_set1_epi8(']'))));
+}
+
+static const char *findMarkSSE2(const char *s, const char *end) {
+    if (end - s < 16) return findMarkScalar(s, end);
+    const char *last = end - 16;
+    for (; s < last; s += 16) {
+        unsigned m = markMaskSSE2(s);
+        if (m) return s + __builtin_ctz(m);
+    }
+    unsigned m = markMaskSSE2(last) >> (s - last);
+    return m ? s + __builtin_ctz(m) : NULL;
+}
+
+static const char *findMarkBackSSE2(const char *s, const char *end) {
+    if (end - s < 16) return findMarkBackScalar(s, end);
+    for (; end - 16 > s; end -= 16) {
+        unsigned m = markMaskSSE2(end - 16);
+        if (m) return end - 16 + (31 - __builtin_clz(m));
+    }
+    // the first vector, keeping only the bytes below end
+    unsigned m = markMaskSSE2(s) & ((1u << (end - s)) - 1);
+    return m ? s + (31 - __builtin_clz(m)) : NULL;
+}
+
+static inline unsigned tokenMaskSSE2(const char *p) {
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    __m128i y = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i cite = _mm_and_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('[')), _mm_cmpeq_epi8(y, _mm_set1_epi8('^')));
+    __m128i code = _mm_and_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('`')), _mm_cmpeq_epi8(y, _mm_set1_epi8('`')));
+    __m128i def = _mm_and_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(']')), _mm_cmpeq_epi8(y, _mm_set1_epi8(':')));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(cite, code), def));
+}
+
+static const char *findTokenSSE2(const char *s, const char *end) {
+    if (end - s < 17) return findTokenScalar(s, end);
+    const char *last = end - 17;
+    for (; s < last; s += 16) {
+        unsigned m = tokenMaskSSE2(s);
+        if (m) return s + __builtin_ctz(m);
+    }
+    unsigned m = tokenMaskSSE2(last) >> (s - last);
+    return m ? s + __builtin_ctz(m) : NULL;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned markMaskAVX2(const char *p) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)p);
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+                                                          _mm256_cmpeq_epi8(x, _mm256_set1_epi8(']'))));
+}
+
+__attribute__((target("avx2")))
+static const char *findMarkAVX2(const char *s, const char *end) {
+    if (end - s < 32) return findMarkSSE2(s, end);
+    const char *last = end - 32;
+    for (; s < last; s += 32) {
+        unsigned m = markMaskAVX2(s);
+        if (m) return s + __builtin_ctz(m);
+    }
+    unsigned m = markMaskAVX2(last) >> (s - last);
+    return m ? s + __builtin_ctz(m) : NULL;
+}
+
+__attribute__((target("avx2")))
+static const char *findMarkBackAVX2(const char *s, const char *end) {
+    if (end - s < 32) return findMarkBackSSE2(s, end);
+    for (; end - 32 > s; end -= 32) {
+        unsigned m = markMaskAVX2(end - 32);
+        if (m) return end - 32 + (31 - __builtin_clz(m));
+    }
+    unsigned m = markMaskAVX2(s);
+    if (end - s < 32) m &= (1u << (end - s)) - 1;
+    return m ? s + (31 - __builtin_clz(m)) : NULL;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned tokenMaskAVX2(const char *p) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)p);
+    __m256i y = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i cite = _mm256_and_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('[')), _mm256_cmpeq_epi8(y, _mm256_set1_epi8('^')));
+    __m256i code = _mm256_and_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('`')), _mm256_cmpeq_epi8(y, _mm256_set1_epi8('`')));
+    __m256i def = _mm256_and_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(']')), _mm256_cmpeq_epi8(y, _mm256_set1_epi8(':')));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(cite, code), def));
+}
+
+__attribute__((target("avx2")))
+static const char *findTokenAVX2(const char *s, const char *end) {
+    if (end - s < 33) return findTokenSSE2(s, end);
+    const char *last = end - 33;
+    for (; s < last; s += 32) {
+        unsigned m = tokenMaskAVX2(s);
+        if (m) return s + __builtin_ctz(m);
+    }
+    unsigned m = tokenMaskAVX2(last) >> (s - last);
+    return m ? s + __builtin_ctz(m) : NULL;
+}
+
+// SSE2 is always there
+static Scanner scan = { findMarkSSE2, findMarkBackSSE2, findTokenSSE2 };
+
+__attribute__((constructor))
+static void initScanner(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan = (Scanner){ findMarkAVX2, findMarkBackAVX2, findTokenAVX2 };
+    }
+}
+#else
+static const Scanner scan = { findMarkScalar, findMarkBackScalar, findTokenScalar };
+#endif
+
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+static void *arenaAlloc(Arena *a, size_t size) {
+    size = ARENA_ALIGN(size);
+    ArenaBlock *b = a->cur;
+    while (b && b->cap - b->used < size) {
+        // move on to a block kept from before the last reset, if it is big enough
+        b = b->next;
+        if (b) b->used = 0;
+    }
+    if (!b) {
+        size_t cap = a->cur ? a->cur->cap * 2 : 65536;
+        if (cap < size) cap = size;
+        b = malloc(sizeof(ArenaBlock) + cap);
+        if (!b) return NULL;
+        b->cap = cap;
+        b->used = 0;
+        // link it in after the current block, ahead of any smaller free ones
+        if (a->cur) {
+            b->next = a->cur->next;
+            a->cur->next = b;
+        } else {
+            b->next = a->head;
+            a->head = b;
+        }
+    }
+    a->cur = b;
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+// Resize an allocation from this arena: in place if it was the last one made,
+// otherwise by copying (the old space is reclaimed at the next reset)
+static void *arenaGrow(Arena *a, void *old, size_t oldSize, size_t newSize) {
+    ArenaBlock *b = a->cur;
+    if (old && b && (char *)old + ARENA_ALIGN(oldSize) == b->data + b->used &&
+        (size_t)((char *)old - b->data) + ARENA_ALIGN(newSize) <= b->cap) {
+        b->used = (size_t)((char *)old - b->data) + ARENA_ALIGN(newSize);
+        return old;
+    }
+    void *p = arenaAlloc(a, newSize);
+    if (p && old) memcpy(p, old, oldSize < newSize ? oldSize : newSize);
+    return p;
+}
+
+static void arenaReset(Arena *a) {
+    a->cur = a->head;
+    if (a->cur) a->cur->used = 0;
+    for (int k = 0; k < a->workerCount; k++) arenaReset(&a->workers[k]);
+}
+
+static void arenaFree(Arena *a) {
+    while (a->head) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->cur = NULL;
+    for (int k = 0; k < a->workerCount; k++) arenaFree(&a->workers[k]);
+    free(a->workers);
+    a->workers = NULL;
+    a->workerCount = 0;
+}
+
+static void *arenaCopy(Arena *a, const void *s, size_t len) {
+    void *copy = arenaAlloc(a, len);
+    if (copy && len) memcpy(copy, s, len);
+    return copy;
+}
+
+// split a buffer into lines
+static int indexLines(Arena *a, LineIndex *idx, const char *data, size_t size) {
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end) {
+        if (idx->count == idx->cap) {
+            int cap = idx->cap ? idx->cap * 2 : 1024;
+            Line *grown = arenaGrow(a, idx->lines, (size_t)idx->cap * sizeof(*grown), (size_t)cap * sizeof(*grown));
+            if (!grown) return -1;
+            idx->lines = grown;
+            idx->cap = cap;
+        }
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *next = nl ? nl + 1 : end;
+        idx->lines[idx->count].text = p;
+        idx->lines[idx->count].len = (size_t)(next - p);
+        idx->count++;
+        p = next;
+    }
+    return 0;
+}
+
+// make room in a growable array for one more element
+static int reserve(Arena *a, void **arr, int *cap, int count, size_t elemSize) {
+    if (count < *cap) return 0;
+    int newCap = *cap ? *cap * 2 : 64;
+    void *grown = arenaGrow(a, *arr, (size_t)*cap * elemSize, (size_t)newCap * elemSize);
+    if (!grown) return -1;
+    *arr = grown;
+    *cap = newCap;
+    return 0;
+}
+
+// append a span of the source buffer, merging it with the previous span if adjacent
+static void emitSpan(Output *out, const char *p, size_t len) {
+    if (len == 0) return;
+    if (out->count > 0) {
+        Segment *last = &out->segs[out->count - 1];
+        if (last->src && last->src + last->len == p) {
+            last->len += len;
+            return;
+        }
+    }
+    if (reserve(out->arena, (void **)&out->segs, &out->cap, out->count, sizeof(Segment)) != 0) {
+        out->failed = 1;
+        return;
+    }
+    out->segs[out->count++] = (Segment){ p, 0, len };
+}
+
+// append replacement text, merging it with the previous piece of text if adjacent
+static void emitText(Output *out, const char *s, size_t len) {
+    if (len == 0) return;
+    if (out->textLen + len > out->textCap) {
+        size_t cap = out->textCap ? out->textCap : 1024;
+        while (cap < out->textLen + len) cap *= 2;
+        char *grown = arenaGrow(out->arena, out->text, out->textCap, cap);
+        if (!grown) { out->failed = 1; return; }
+        out->text = grown;
+        out->textCap = cap;
+    }
+    memcpy(out->text + out->textLen, s, len);
+    if (out->count > 0) {
+        Segment *last = &out->segs[out->count - 1];
+        if (!last->src && last->off + last->len == out->textLen) {
+            last->len += len;
+            out->textLen += len;
+            return;
+        }
+    }
+    if (reserve(out->arena, (void **)&out->segs, &out->cap, out->count, sizeof(Segment)) != 0) {
+        out->failed = 1;
+        return;
+    }
+    out->segs[out->count++] = (Segment){ NULL, out->textLen, len };
+    out->textLen += len;
+}
+
+// append n spaces (the normalized leading whitespace of a full entry)
+static void emitPadding(Output *out, size_t n) {
+    static const char spaces[] = "                                ";
+    while (n > 0) {
+        size_t k = n < sizeof(spaces) - 1 ? n : sizeof(spaces) - 1;
+        emitText(out, spaces, k);
+        n -= k;
+    }
+}
+
+// write the decimal digits of a positive number to the end of buf[0, size),
+// returning where they start (snprintf is the bulk of rendering otherwise)
+static char *formatNumber(char *buf, size_t size, int num) {
+    char *p = buf + size;
+    do {
+        *--p = (char)('0' + num % 10);
+        num /= 10;
+    } while (num > 0);
+    return p;
+}
+
+// append a renumbered marker, "[^N]" followed by suffix
+static void emitMarker(Output *out, int num, const char *suffix) {
+    char buf[32];
+    char *digits = formatNumber(buf, 16, num);
+    size_t n = 16 - (size_t)(digits - buf);
+    memcpy(buf, "[^", 2);
+    memmove(buf + 2, digits, n);
+    buf[2 + n] = ']';
+    size_t slen = strlen(suffix);
+    memcpy(buf + 3 + n, suffix, slen);
+    emitText(out, buf, 3 + n + slen);
+}
+
+// the current end of the output, as a segment and an offset into it
+static void outputEnd(const Output *out, int *seg, size_t *off) {
+    *seg = out->count ? out->count - 1 : 0;
+    *off = out->count ? out->segs[out->count - 1].len : 0;
+}
+
+// note that input line `line` starts here in the output (with opts->diff)
+static void beginSpan(Output *out, int line) {
+    if (!out->lines) return;
+    if (reserve(out->arena, (void **)&out->spans, &out->spanCap, out->spanCount, sizeof(LineSpan)) != 0) {
+        out->failed = 1;
+        return;
+    }
+    LineSpan *sp = &out->spans[out->spanCount++];
+    sp->line = line;
+    outputEnd(out, &sp->seg, &sp->off);
+}
+
+// and that it ends here
+static void endSpan(Output *out) {
+    if (!out->lines || out->failed) return;
+    LineSpan *sp = &out->spans[out->spanCount - 1];
+    outputEnd(out, &sp->endSeg, &sp->endOff);
+}
+
+// write every segment to f, with writev where available. A stream without a
+// descriptor of its own (open_memstream(), fmemopen(), fopencookie()) is
+// written through stdio instead.
+static int flushOutput(Output *out, FILE *f) {
+    if (out->failed) return -1;
+#ifdef HAVE_WRITEV
+    int fd = fileno(f);
+    if (fd >= 0) {
+        if (fflush(f) != 0) return -1;
+        struct iovec iov[1024];
+        int s = 0;
+        size_t done = 0; // bytes of segs[s] already written
+        while (s < out->count) {
+            int n = 0;
+            for (int k = s; k < out->count && n < 1024; k++, n++) {
+                const Segment *seg = &out->segs[k];
+                const char *base = seg->src ? seg->src : out->text + seg->off;
+                size_t skip = k == s ? done : 0;
+                iov[n].iov_base = (void *)(base + skip);
+                iov[n].iov_len = seg->len - skip;
+            }
+            ssize_t w = writev(fd, iov, n);
+            if (w < 0) return -1;
+            // advance past what was written, which may end part-way through a segment
+            size_t left = (size_t)w;
+            while (s < out->count && left >= out->segs[s].len - done) {
+                left -= out->segs[s].len - done;
+                done = 0;
+                s++;
+            }
+            done += left;
+        }
+        return 0;
+    }
+#endif
+    for (int k = 0; k < out->count; k++) {
+        const Segment *seg = &out->segs[k];
+        const char *base = seg->src ? seg->src : out->text + seg->off;
+        if (fwrite(base, 1, seg->len, f) != seg->len) return -1;
+    }
+    return 0;
+}
+
+static bool sameLabel(const char *a, int alen, const char *b, int blen) {
+    return alen == blen && memcmp(a, b, (size_t)alen) == 0;
+}
+
+// FNV-1a
+static unsigned hashLabel(const char *s, int len) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static LabelSlot *probeLabel(const LabelIndex *idx, const FullEntry *entries, const char *label, int len, unsigned h) {
+    unsigned mask = (unsigned)idx->cap - 1;
+    for (unsigned i = h & mask; ; i = (i + 1) & mask) {
+        LabelSlot *slot = &idx->slots[i];
+        if (slot->head < 0) return slot;
+        const FullEntry *e = &entries[slot->head];
+        if (slot->hash == h && sameLabel(e->label, e->labelLen, label, len)) return slot;
+    }
+}
+
+// returns the slot for label, or NULL if no full entry has it
+static LabelSlot *findLabel(const LabelIndex *idx, const FullEntry *entries, const char *label, int len) {
+    if (idx->count == 0) return NULL;
+    LabelSlot *slot = probeLabel(idx, entries, label, len, hashLabel(label, len));
+    return slot->head < 0 ? NULL : slot;
+}
+
+// index entries[entryIdx] by its label, chaining it behind any earlier entry with the same label
+static int addLabel(LabelIndex *idx, FullEntry *entries, int entryIdx) {
+    // keep the load factor under 1/2
+    if ((idx->count + 1) * 2 > idx->cap) {
+        LabelIndex grown = { NULL, idx->cap ? idx->cap * 2 : 256, idx->count, idx->arena };
+        grown.slots = arenaAlloc(idx->arena, (size_t)grown.cap * sizeof(LabelSlot));
+        if (!grown.slots) return -1;
+        for (int i = 0; i < grown.cap; i++) grown.slots[i].head = -1;
+        for (int i = 0; i < idx->cap; i++) {
+            if (idx->slots[i].head >= 0) {
+                const FullEntry *e = &entries[idx->slots[i].head];
+                *probeLabel(&grown, entries, e->label, e->labelLen, idx->slots[i].hash) = idx->slots[i];
+            }
+        }
+        *idx = grown;
+    }
+
+    FullEntry *entry = &entries[entryIdx];
+    unsigned h = hashLabel(entry->label, entry->labelLen);
+    LabelSlot *slot = probeLabel(idx, entries, entry->label, entry->labelLen, h);
+    entry->nextSame = -1;
+    if (slot->head < 0) {
+        slot->hash = h;
+        slot->id = idx->count;
+        slot->head = slot->last = slot->cursor = entryIdx;
+        slot->lastLine = -1;
+        idx->count++;
+    } else {
+        entries[slot->last].nextSame = entryIdx;
+        slot->last = entryIdx;
+    }
+    return 0;
+}
+
+static int pushToken(TokenStream *ts, TokenType type, int line, size_t start, size_t end,
+                     size_t label, size_t labelLen) {
+    if (reserve(ts->arena, (void **)&ts->toks, &ts->cap, ts->count, sizeof(Token)) != 0) return -1;
+    Token *tok = &ts->toks[ts->count++];
+    tok->type = (unsigned char)type;
+    tok->line = line;
+    tok->start = (unsigned)start;
+    tok->end = (unsigned)end;
+    tok->label = (unsigned)label;
+    tok->labelLen = (unsigned)labelLen;
+    return 0;
+}
+
+// Lex one line: fences, full-entry definitions, inline code spans and in-text citations
+static int lexLine(TokenStream *ts, const Line *line, int lineIdx, int *insideFence) {
+    const char *text = line->text;
+    const char *end = text + line->len;
+
+    // skip leading spaces
+    const char *s = text;
+    while (s < end && isspace((unsigned char)*s)) s++;
+
+    if (end - s >= 3 && strncmp(s, "```", 3) == 0) {
+        *insideFence = !*insideFence; // toggle
+        return pushToken(ts, TOK_FENCE, lineIdx, 0, line->len, 0, 0);
+    }
+    if (*insideFence) return 0; // inside code block
+
+    // lines containing "]:" never hold in-text citations, but may be a full entry
+    if (findPair(text, end, ']', ':')) {
+        // must start with '[^', thus don't need to worry about being inside inline code
+        if (end - s < 2 || s[0] != '[' || s[1] != '^') return 0;
+        const char *close = memchr(s + 2, ']', (size_t)(end - (s + 2)));
+        // next character must be ':'
+        if (!close || close + 1 >= end || close[1] != ':') return 0;
+        return pushToken(ts, TOK_DEF, lineIdx, (size_t)(s - text), (size_t)(close + 2 - text),
+                         (size_t)(s + 2 - text), (size_t)(close - (s + 2)));
+    }
+
+    // inline code spans, found once per line: a run of backticks up to the
+    // next run of the same length, as in CommonMark (`code`, ``co`de``)
+    int firstSpan = ts->count;
+    unsigned long long unmatched = 0; // run lengths (up to 64) with no run left to close them
+    for (const char *p = text; (p = memchr(p, '`', (size_t)(end - p))) != NULL; ) {
+        const char *q = p;
+        while (q < end && *q == '`') q++;
+        size_t run = (size_t)(q - p);
+        const char *close = NULL;
+        if (run > 64 || !(unmatched >> (run - 1) & 1)) {
+            for (const char *r = q; (r = memchr(r, '`', (size_t)(end - r))) != NULL; ) {
+                const char *re = r;
+                while (re < end && *re == '`') re++;
+                if ((size_t)(re - r) == run) {
+                    close = re;
+                    break;
+                }
+                r = re;
+            }
+        }
+        if (!close) {
+            // literal backticks, and so is every later run of this length
+            if (run <= 64) unmatched |= 1ULL << (run - 1);
+            p = q;
+            continue;
+        }
+        if (pushToken(ts, TOK_CODE_SPAN, lineIdx, (size_t)(p - text), (size_t)(close - text), 0, 0) != 0) return -1;
+        p = close;
+    }
+    int lastSpan = ts->count;
+
+    // in-text citations, single or stacked
+    int span = firstSpan;
+    int prevCite = -1;
+    int stack = -1;
+    for (const char *p = text; (p = findPair(p, end, '[', '^')) != NULL; ) {
+        const char *close = memchr(p + 2, ']', (size_t)(end - (p + 2)));
+        if (!close) break; // no closing bracket anywhere → no more citations in this line
+
+        // a footnote inside inline code ends the search in this line
+        size_t at = (size_t)(p - text);
+        while (span < lastSpan && ts->toks[span].end <= at) span++;
+        if (span < lastSpan && ts->toks[span].start < at) break;
+
+        // trim spaces around the label (main() will handle the case where it is empty)
+        const char *ls = p + 2;
+        const char *le = close;
+        while (ls < le && isspace((unsigned char)*ls)) ls++;
+        while (le > ls && isspace((unsigned char)le[-1])) le--;
+
+        if (prevCite >= 0 && ts->toks[prevCite].end == at) {
+            if (stack < 0) {
+                // the previous citation opens a stack: put a TOK_STACK in front of it
+                if (reserve(ts->arena, (void **)&ts->toks, &ts->cap, ts->count, sizeof(Token)) != 0) return -1;
+                ts->toks[ts->count++] = ts->toks[prevCite];
+                stack = prevCite++;
+                ts->toks[stack].type = TOK_STACK;
+                ts->toks[stack].labelLen = 1;
+            }
+            ts->toks[stack].labelLen++;
+            ts->toks[stack].end = (unsigned)(close + 1 - text);
+        } else {
+            stack = -1;
+        }
+        prevCite = ts->count;
+        if (pushToken(ts, TOK_CITE, lineIdx, at, (size_t)(close + 1 - text),
+                      (size_t)(ls - text), (size_t)(le - ls)) != 0) return -1;
+        p = close + 1;
+    }
+    return 0;
+}
+
+// Lex lines [from, to), which must follow one another in one buffer (as
+// indexLines() leaves them). A line without "[^", "``" or "]:" holds no
+// footnote (a code span there hides nothing) and cannot be a fence, so such
+// lines are skipped by scanning across them for the next of those pairs.
+// With lineTok, each line's first token and fence state are recorded as well
+// (see citeorder_doc).
+static int lexLines(const Line *lines, int from, int to, TokenStream *ts, int *fence,
+                    int *lineTok, unsigned char *inFence) {
+    if (from >= to) return 0;
+    const char *end = lines[to - 1].text + lines[to - 1].len;
+    const char *next = scan.findToken(lines[from].text, end);
+    for (int i = from; i < to; i++) {
+        if (lineTok) {
+            lineTok[i] = ts->count;
+            inFence[i] = (unsigned char)*fence;
+        }
+        const Line *l = &lines[i];
+        if (!next || next >= l->text + l->len) continue;
+        if (lexLine(ts, l, i, fence) != 0) return -1;
+        next = scan.findToken(l->text + l->len, end);
+    }
+    return 0;
+}
+
+// Lex the whole document into one token stream, in a single pass over the lines
+static int lexDocument(const Line *lines, int lineCount, TokenStream *ts) {
+    int insideFence = 0;
+    return lexLines(lines, 0, lineCount, ts, &insideFence, NULL, NULL);
+}
+
+// Marks that decide whether a closing quote has an opening one:
+// a '"', or the ']' of a previous in-text citation [^n] (which means no opening quote)
+enum { MARK_NONE = 0, MARK_QUOTE, MARK_CITE };
+
+static int markAt(const char *line, size_t i) {
+    // check if hit a previous in-text citation before reaching a quote
+    if (i > 2 && line[i] == ']' && isdigit((unsigned char)line[i - 1]) &&
+        line[i - 2] == '^' && line[i - 3] == '[') {
+        return MARK_CITE;
+    }
+    if (line[i] == '"') return MARK_QUOTE;
+    return MARK_NONE;
+}
+
+// scan line right-to-left from `to` down to `from` looking for a '"' or a '[^n]'
+static int backScanForQuote(const char *line, size_t from, size_t to) {
+    const char *p;
+    while ((p = scan.findMarkBack(line + from, line + to)) != NULL) {
+        to = (size_t)(p - line);
+        int mark = markAt(line, to);
+        if (mark != MARK_NONE) return mark;
+    }
+    return MARK_NONE;
+}
+
+// Quote state carried forward through the document during collection, so that
+// finding the opening quote never has to walk back over previous lines
+typedef struct {
+    int line;        // line currently being scanned
+    size_t scanned;  // bytes of that line scanned so far (left-to-right)
+    int last;        // last mark within the scanned bytes
+    int carried;     // last mark of all lines before `line`
+    long backtracks; // lines (or parts of the current one) scanned again, for stats
+} QuoteState;
+
+// finish the quote state's current line l and move on to the next line
+static void advanceQuoteLine(QuoteState *qs, const Line *l) {
+    // the rest of the line was not scanned yet, so look at it right-to-left
+    int mark = backScanForQuote(l->text, qs->scanned, l->len);
+    if (mark == MARK_NONE) mark = qs->last;
+    if (mark != MARK_NONE) qs->carried = mark;
+    qs->line++;
+    qs->scanned = 0;
+    qs->last = MARK_NONE;
+}
+
+// move the quote state forward to the start of lineNum. Only the last mark
+// matters, so the lines are scanned from lineNum back, stopping at the first.
+static void seekQuoteState(QuoteState *qs, const Line *lines, int lineNum) {
+    if (qs->line >= lineNum) return;
+    int mark = MARK_NONE;
+    for (int k = lineNum - 1; k > qs->line && mark == MARK_NONE; k--) {
+        mark = backScanForQuote(lines[k].text, 0, lines[k].len);
+        qs->backtracks++;
+    }
+    if (mark == MARK_NONE) {
+        // back at the current line: finish it as advanceQuoteLine() would
+        advanceQuoteLine(qs, &lines[qs->line]);
+    } else {
+        qs->carried = mark;
+    }
+    qs->line = lineNum;
+    qs->scanned = 0;
+    qs->last = MARK_NONE;
+}
+
+// last mark before line[pos], falling back to the last mark of the previous lines.
+// The quote state must already be on this line.
+static int markBefore(QuoteState *qs, const char *line, size_t pos) {
+    if (pos < qs->scanned) {
+        // citations are checked left-to-right, but rescan the line if not
+        qs->scanned = 0;
+        qs->last = MARK_NONE;
+        qs->backtracks++;
+    }
+    const char *p = line + qs->scanned;
+    while ((p = scan.findMark(p, line + pos)) != NULL) {
+        int mark = markAt(line, (size_t)(p - line));
+        if (mark != MARK_NONE) qs->last = mark;
+        p++;
+    }
+    qs->scanned = pos;
+    return qs->last != MARK_NONE ? qs->last : qs->carried;
+}
+
+// Check if citation is properly after quotes/punctuation
+// (the quote state must already be on the citation's line)
+static int hasProperQuoteContext(QuoteState *qs, const char *line, size_t cite) {
+    
+    int cite_idx = (int)cite;  // index of '[' for this exact unique citation [^citeNum]
+    if (cite_idx == 0) return 0; // citation starts the line, nothing to its left
+
+    int q = cite_idx;
+    q--; // q pointing to the left of cite_idx '['
+    
+    // check if cite_idx '[' is to the left of a closing footnote ']'
+    if (line[q] == ']') {
+        // scan backwards for '[^', leaving enough room for at least "A"
+        while (q > 3) {
+            // if to the left of a stack, return true (already checked footnotes to the left) 
+            if (line[q-1] == '[' && line[q] == '^') {
+                return 1;
+            }
+            q--;
+        }
+        // could not find opening '[^' for ']' to its left, therefore not proper quote context
+        return 0;
+    }
+
+    int end_quote = 0;
+    char c = line[cite_idx - 1];
+    // check if cite_idx '[' is to the left of an end quote '"'
+    if (c == '"') {
+	    end_quote = cite_idx - 1;
+    }
+    // allow at most 1 punctuation directly after the end quote
+    if (c == ',' || c == '.' || c == ';' || c == ':' || c == '?' || c == '!' || c == ')') {
+	    if (cite_idx >= 2 && line[cite_idx - 2] == '"') {
+	        end_quote = cite_idx - 2;
+	    }
+    }
+    
+    // If there is no closing quote before the citation, it's invalid.
+    if (end_quote == 0) return 0;
+
+    // Find the mark before the closing quote: it must be an opening quote rather than a
+    // previous in-text citation, and could be in a line prior.
+    return markBefore(qs, line, (size_t)end_quote) == MARK_QUOTE;
+}
+
+// Sort count numbers in place, by their byte at shift and then the lower
+// ones: an American flag sort, which needs no memory beyond its counts. Short
+// runs are insertion sorted.
+static void sortNums(int *nums, int count, int shift) {
+    if (count <= 16) {
+        for (int a = 1; a < count; a++) {
+            int num = nums[a], b = a;
+            for (; b > 0 && nums[b - 1] > num; b--) nums[b] = nums[b - 1];
+            nums[b] = num;
+        }
+        return;
+    }
+    int start[257] = { 0 }, next[256];
+    for (int a = 0; a < count; a++) start[((unsigned)nums[a] >> shift & 255) + 1]++;
+    for (int d = 0; d < 256; d++) start[d + 1] += start[d];
+    memcpy(next, start, sizeof(next));
+    // swap each number into its bucket until every bucket holds only its own
+    for (int d = 0; d < 256; d++) {
+        while (next[d] < start[d + 1]) {
+            int num = nums[next[d]];
+            int to = (int)((unsigned)num >> shift & 255);
+            if (to == d) {
+                next[d]++;
+            } else {
+                nums[next[d]] = nums[next[to]];
+                nums[next[to]++] = num;
+            }
+        }
+    }
+    if (shift == 0) return;
+    for (int d = 0; d < 256; d++) sortNums(nums + start[d], start[d + 1] - start[d], shift - 8);
+}
+
+// Sort the numbers of a stack of citations ascending, in time linear in its length
+static void sortStack(int *nums, int count) {
+    int max = 0;
+    for (int a = 0; a < count; a++) {
+        if (nums[a] > max) max = nums[a];
+    }
+    int shift = 0;
+    while (shift < 24 && (max >> (shift + 8)) != 0) shift += 8;
+    sortNums(nums, count, shift);
+}
+
+// Emit a line with its in-text citations renumbered, keeping stacked citations sorted.
+// toks are the line's tokens and nums the numbers to write for its citations, in order.
+static void updateLineInTexts(Output *out, const Line *line, const Token *toks, int ntoks, int *nums) {
+    const char *p = line->text;
+    for (int t = 0; t < ntoks; t++) {
+        const Token *tok = &toks[t];
+        int n;
+        if (tok->type == TOK_STACK) {
+            n = (int)tok->labelLen;
+            sortStack(nums, n);
+            t += n; // the stack's citations are written here
+        } else if (tok->type == TOK_CITE) {
+            n = 1;
+        } else {
+            continue;
+        }
+        // the text up to the citations is unchanged, then the new numbers
+        emitSpan(out, p, (size_t)(line->text + tok->start - p));
+        for (int k = 0; k < n; k++) {
+            emitMarker(out, nums[k], "");
+        }
+        p = line->text + tok->end;
+        nums += n;
+    }
+    emitSpan(out, p, (size_t)(line->text + line->len - p));
+}
+
+// helper: check if string is purely digits
+static bool isNumeric(const char *s, int len) {
+    if (!s || len <= 0) return false;
+    for (int i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)s[i]))
+            return false;
+    }
+    return true;
+}
+
+// helper: the number a label is written as, or -1 if it is not one (leading
+// zeros, or too big), so that a citation changed iff this is not its new number
+static int labelNumber(const char *label, int len) {
+    if (!isNumeric(label, len) || (len > 1 && label[0] == '0') || len > 10) return -1;
+    long long num = 0;
+    for (int k = 0; k < len; k++) num = num * 10 + (label[k] - '0');
+    return num <= INT_MAX ? (int)num : -1;
+}
+
+// Grow a citation table to cap rows, moving its columns into one new block
+static int growCites(Arena *a, CiteTable *t, int cap) {
+    int *block = arenaAlloc(a, (size_t)cap * 3 * sizeof(int));
+    if (!block) return -1;
+    if (t->count) {
+        memcpy(block, t->line, (size_t)t->count * sizeof(int));
+        memcpy(block + cap, t->newNum, (size_t)t->count * sizeof(int));
+        memcpy(block + 2 * cap, t->writeNum, (size_t)t->count * sizeof(int));
+    }
+    t->line = block;
+    t->newNum = block + cap;
+    t->writeNum = block + 2 * cap;
+    t->cap = cap;
+    return 0;
+}
+
+// helper: check if a label contains any spaces
+static bool hasSpace(const char *label, int len) {
+    for (int k = 0; k < len; k++) {
+        if (isspace((unsigned char)label[k])) return true;
+    }
+    return false;
+}
+
+// What was found out about an in-text citation ahead of collecting it, when a
+// document is split across threads (see processChunks)
+typedef struct {
+    LabelSlot *slot; // its label's, or NULL if no full entry has it
+    int quoted;      // it has a proper quote context (or quotes are relaxed)
+} CitePrep;
+
+// Everything learnt about a document's footnotes while collecting them: the
+// full entries and their label index, the numbers handed out so far and the
+// relaxed-duplicates bookkeeping. Shared by the in-memory and streaming paths.
+typedef struct {
+    const citeorder_opts *opts;
+    citeorder_result *result; // where an error is reported
+    FullEntry *fullEntries;
+    int fullCount, fullCap;
+    CiteTable cites;         // in-memory only, streaming rewrites without them
+    int keepCites;
+    LabelIndex labels;       // label -> full entries
+    const char *dupLabel;    // the one duplicate label allowed by -d, for messages
+    int dupLen;
+    int dupId;               // ...and its id in labels
+    int numDupFull;
+    int numDupIn;
+    int *dupNums;            // streaming only: number given to each citation of dupLabel, in order
+    int dupNumCount, dupNumCap;
+    int copyLabels;          // streaming only: labels are copied into the arena
+    Arena *arena;
+    int nextNum;
+    bool changed;
+    int firstChange;         // in-memory only: first in-text citation that was renumbered, -1 if none
+    citeorder_stats *stats;  // the result's, or NULL without opts->stats
+} Collector;
+
+// Stats
+// -----
+// The clock is only read with opts->stats, once at each phase boundary.
+
+static double now(void) {
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// seconds since *tick, which moves on to now
+static double lap(double *tick) {
+    double prev = *tick;
+    *tick = now();
+    return *tick - prev;
+}
+
+// total size of an output's segments
+static size_t outputSize(const Output *out) {
+    size_t n = 0;
+    for (int k = 0; k < out->count; k++) n += out->segs[k].len;
+    return n;
+}
+
+// Count what an in-memory document held, once it has been collected (and
+// perhaps rendered) or an error stopped it
+static void countStats(citeorder_stats *st, const Collector *c, const LineIndex *idx,
+                       const TokenStream *ts, size_t len) {
+    st->lines = idx->count;
+    st->full_entries = c->fullCount;
+    st->in_texts = c->cites.count;
+    for (int t = 0; t < ts->count; t++) {
+        if (ts->toks[t].type == TOK_STACK) st->stacks++;
+    }
+    st->bytes_in = len;
+    if (c->result->output) st->bytes_out = outputSize(c->result->output);
+}
+
+// Report an error in the result; always returns 1
+static int fail(Collector *c, citeorder_status status, int line, const char *hint, const char *fmt, ...) {
+    citeorder_result *r = c->result;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    r->status = status;
+    r->line = line;
+    r->hint = hint;
+    r->message = n >= 0 ? arenaAlloc(c->arena, (size_t)n + 1) : NULL;
+    if (r->message) {
+        va_start(ap, fmt);
+        vsnprintf(r->message, (size_t)n + 1, fmt, ap);
+        va_end(ap);
+    }
+    return 1;
+}
+
+// Report a failed system call
+static int failErrno(Collector *c, citeorder_status status, const char *what) {
+    return fail(c, status, 0, NULL, "%s: %s", what, strerror(errno));
+}
+
+// Check mode: the label on line i would be renumbered, which is all there is
+// to find out. Always returns 1, to stop collecting.
+static int stopCheck(Collector *c, int i) {
+    c->changed = true;
+    c->result->changed = 1;
+    c->result->line = i+1;
+    return 1;
+}
+
+// Check mode reads the document in order and stops at the first label that
+// would be renumbered, without lexing (or, streaming, reading) the rest. While
+// every label so far is a number in order, the citations seen have used
+// exactly 1..next-1, so a citation is in order iff its label is one of those
+// or next, and a full entry iff its label is a number at all. Stopping there
+// means an error on that line or further on, or a citation whose full entry
+// is missing, goes unreported. A label that is empty or holds a space is itself an error, which
+// the full passes report in their own order, so at the first of those the
+// whole document is read after all.
+typedef struct {
+    int next; // the number the next label cited for the first time must have; 0 once given up
+} OrderCheck;
+
+// Whether tok, on a line starting at text, is a label out of order
+static bool outOfOrder(OrderCheck *oc, const char *text, const Token *tok) {
+    if (!oc->next || (tok->type != TOK_CITE && tok->type != TOK_DEF)) return false;
+    const char *label = text + tok->label;
+    int labelLen = (int)tok->labelLen;
+    if (labelLen == 0 || hasSpace(label, labelLen)) {
+        oc->next = 0;
+        return false;
+    }
+    int num = labelNumber(label, labelLen);
+    if (tok->type == TOK_DEF) return num < 1;
+    if (num < 1 || num > oc->next) return true;
+    if (num == oc->next) oc->next++;
+    return false;
+}
+
+// Record the full entry [^label]: on line i. Returns 0, or 1 after reporting an
+// error (or, in check mode, finding a label that would change).
+static int collectDef(Collector *c, const char *label, int labelLen, int i) {
+    // check if label has length=0
+    if (labelLen == 0) {
+        return fail(c, CITEORDER_ERR_MISSING_LABEL, i+1, NULL,
+                    "[^] full-entry citation missing label (line %d)", i+1);
+    }
+    // check if label contains any spaces
+    if (hasSpace(label, labelLen)) {
+        return fail(c, CITEORDER_ERR_LABEL_SPACE, i+1, NULL,
+                    "[^%.*s] full-entry citation contains a space (line %d)", labelLen, label, i+1);
+    }
+    // look up the label index to check if duplicate
+    LabelSlot *seen = findLabel(&c->labels, c->fullEntries, label, labelLen);
+    if (seen) {
+        // ONE duplicate allowed
+        if (c->opts->relaxed_duplicates) {
+            // first duplicate found
+            if (c->dupLabel == NULL) {
+                c->dupLabel = c->fullEntries[seen->head].label;
+                c->dupLen = labelLen;
+                c->dupId = seen->id;
+                c->numDupFull = 2;
+            // first duplicate previously found already
+            } else {
+                // this duplicate is DIFFERENT from first duplicate found
+                if (seen->id != c->dupId) {
+                    return fail(c, CITEORDER_ERR_MULTIPLE_DUPLICATES, i+1, NULL,
+                                "relaxed-duplicates (-d) mode allows only ONE full-entry duplicate (found: [^%.*s] and [^%.*s] duplicates)",
+                                c->dupLen, c->dupLabel, labelLen, label);
+                // this duplicate is the SAME as first duplicate found
+                } else {
+                    c->numDupFull++;
+                }
+            }
+        // NO duplicates allowed
+        } else {
+            return fail(c, CITEORDER_ERR_DUPLICATE, i+1,
+                        "Use the '-d' flag to relax duplicate handling. Run 'citeorder -h' for more info",
+                        "duplicate [^%.*s] full-entry citations (line %d and %d)",
+                        labelLen, label, c->fullEntries[seen->head].lineIdx+1, i+1);
+        }
+    }
+
+    // every full entry ends up with a number
+    if (c->opts->check && !isNumeric(label, labelLen)) return stopCheck(c, i);
+
+    if (c->copyLabels && !(label = arenaCopy(c->arena, label, (size_t)labelLen))) {
+        return failErrno(c, CITEORDER_ERR_NO_MEMORY, "malloc");
+    }
+    if (reserve(c->arena, (void **)&c->fullEntries, &c->fullCap, c->fullCount, sizeof(FullEntry)) != 0) {
+        return failErrno(c, CITEORDER_ERR_NO_MEMORY, "realloc");
+    }
+    FullEntry *fe = &c->fullEntries[c->fullCount];
+    fe->label    = label;
+    fe->labelLen = labelLen;
+    fe->labelNum = labelNumber(label, labelLen);
+    fe->lineIdx  = i;
+    fe->newNum   = 0;        // assign later
+    if (addLabel(&c->labels, c->fullEntries, c->fullCount) != 0) {
+        return failErrno(c, CITEORDER_ERR_NO_MEMORY, "malloc");
+    }
+    c->fullCount++;
+    return 0;
+}
+
+// Check the in-text citation tok on line i and give its full entry the next
+// number if it has none yet. qs must already be on line i, unless prep has its
+// label lookup and quote check done already.
+// Returns 0, or 1 after reporting an error (or, in check mode, a change).
+static int collectCite(Collector *c, QuoteState *qs, const Line *line, const Token *tok, int i,
+                       const CitePrep *prep) {
+    const char *label = line->text + tok->label;
+    int labelLen = (int)tok->labelLen;
+
+    // check if label has length<=0
+    if (labelLen == 0) {
+        return fail(c, CITEORDER_ERR_MISSING_LABEL, i+1, NULL,
+                    "in-text citation [^] missing label (line %d)", i+1);
+    }
+    // check if label contains any spaces
+    if (hasSpace(label, labelLen)) {
+        return fail(c, CITEORDER_ERR_LABEL_SPACE, i+1, NULL,
+                    "in-text citation [^%.*s] contains a space (line %d)", labelLen, label, i+1);
+    }
+    LabelSlot *slot = prep ? prep->slot : findLabel(&c->labels, c->fullEntries, label, labelLen);
+    // check if in-text matches duplicate full-entry
+    if (c->opts->relaxed_duplicates) {
+        if (c->dupLabel && slot && slot->id == c->dupId) {
+            c->numDupIn++;
+        }
+        // check if number of duplicate in-texts > number of duplicate full-entries
+        if (c->numDupIn > c->numDupFull) {
+            return fail(c, CITEORDER_ERR_UNEQUAL_DUPLICATES, i+1, NULL,
+                        "relaxed-duplicates (-d) mode expects EQUAL number of full-entry and in-text duplicates (found: %d [^%.*s] full-entries, %d [^%.*s] in-texts)",
+                        c->numDupFull, labelLen, label, c->numDupIn, labelLen, label);
+        }
+    }
+    // find the corresponding full entry
+    FullEntry *entry=NULL;
+    if (slot) {
+        if (c->opts->relaxed_duplicates) {
+            // skip duplicates whose matched full-entry is already assigned,
+            // falling back to the last one once every duplicate has a number
+            while (slot->cursor >= 0 && c->fullEntries[slot->cursor].newNum != 0) {
+                slot->cursor = c->fullEntries[slot->cursor].nextSame;
+            }
+            entry = &c->fullEntries[slot->cursor >= 0 ? slot->cursor : slot->last];
+        } else {
+            entry = &c->fullEntries[slot->head];
+        }
+    }
+    if(!entry) {
+        return fail(c, CITEORDER_ERR_MISSING_ENTRY, i+1, NULL,
+                    "in-text citation [^%.*s] without full-entry (line %d)", labelLen, label, i+1);
+    }
+    if (!c->opts->relaxed_quotes) {
+        if (prep ? !prep->quoted : !hasProperQuoteContext(qs, line->text, tok->start)) {
+            return fail(c, CITEORDER_ERR_QUOTE, i+1,
+                        "Use the '-q' flag to relax quote handling. Run 'citeorder -h' for more info",
+                        "in-text citation [^%.*s] not properly quoted (line %d)", labelLen, label, i+1);
+        }
+    }
+
+    // assign matching full-entry the next number if not already assigned
+    if(entry->newNum == 0){
+        entry->newNum = c->nextNum++;
+    }
+    if (entry->labelNum != entry->newNum) {
+        if (c->opts->check) return stopCheck(c, i);
+        if (c->firstChange < 0) c->firstChange = c->cites.count;
+        c->changed = true;
+    }
+
+    if (!c->keepCites) {
+        // remember which duplicate each citation of the duplicate label went to,
+        // so the rewrite can replay it without the cursor walk
+        if (slot->head != slot->last) {
+            if (reserve(c->arena, (void **)&c->dupNums, &c->dupNumCap, c->dupNumCount, sizeof(int)) != 0) {
+                return failErrno(c, CITEORDER_ERR_NO_MEMORY, "realloc");
+            }
+            c->dupNums[c->dupNumCount++] = entry->newNum;
+        }
+        return 0;
+    }
+    CiteTable *t = &c->cites;
+    if (t->count == t->cap && growCites(c->arena, t, t->cap ? 2 * t->cap : 16) != 0) {
+        return failErrno(c, CITEORDER_ERR_NO_MEMORY, "realloc");
+    }
+    t->line[t->count]   = i;
+    t->newNum[t->count] = entry->newNum;
+    // a label repeated on the same line is written with the number of its first citation there
+    if (slot->lastLine != i) {
+        slot->lastLine = i;
+        slot->lastLineNum = entry->newNum;
+    }
+    t->writeNum[t->count] = slot->lastLineNum;
+    t->count++;
+    return 0;
+}
+
+// Final checks once every citation is collected, then number the unused
+// full entries. Returns 0, or 1 after reporting an error.
+static int finishCollect(Collector *c) {
+    // check if number of duplicate in-texts < number of duplicate full-entries
+    if (c->numDupIn < c->numDupFull) {
+        return fail(c, CITEORDER_ERR_UNEQUAL_DUPLICATES, 0, NULL,
+                    "relaxed-duplicates (-d) mode expects EQUAL number of full-entry and in-text duplicates (found: %d [^%.*s] full-entries, %d [^%.*s] in-texts)",
+                    c->numDupFull, c->dupLen, c->dupLabel, c->numDupIn, c->dupLen, c->dupLabel);
+    }
+
+    // Unused fullEntries get bubbled to the top
+    // -----------------------------------------
+    int numUnusedFullEntry = 0;
+    for (int i = 0; i < c->fullCount; i++) {
+	    if (c->fullEntries[i].newNum == 0) {
+	        numUnusedFullEntry++;
+	    }
+    }
+    int k = 1;
+    for (int j = 0; j < c->fullCount; j++) {
+        if (c->fullEntries[j].newNum == 0) {
+            c->fullEntries[j].newNum = c->fullCount - numUnusedFullEntry + k;
+	        k++;
+        }
+    }
+
+    // Check if anything changed (in-text citations were checked as they were collected)
+    // -------------------------
+    for (int i = 0; i < c->fullCount && !c->changed; i++) {
+        if (c->fullEntries[i].labelNum != c->fullEntries[i].newNum) {
+            if (c->opts->check) return stopCheck(c, c->fullEntries[i].lineIdx);
+            c->changed = true;
+        }
+    }
+    return 0;
+}
+
+// Give the result an empty report in a, to be filled in by buildReport().
+// Returns 0, or 1 if out of memory.
+static int startReport(citeorder_result *result, Arena *a) {
+    result->report = arenaAlloc(a, sizeof(Report));
+    if (!result->report) {
+        result->status = CITEORDER_ERR_NO_MEMORY;
+        return 1;
+    }
+    memset(result->report, 0, sizeof(Report));
+    result->report->arena = a;
+    return 0;
+}
+
+// Set up a result for a new document, reusing its arena if it has one, and a
+// collector working in that arena. Returns 0, or 1 if out of memory.
+static int prepareResult(citeorder_result *result, Collector *c, const citeorder_opts *opts) {
+    Arena *arena = result->arena;
+    memset(result, 0, sizeof(*result));
+    if (!arena && (arena = calloc(1, sizeof(Arena))) == NULL) {
+        result->status = CITEORDER_ERR_NO_MEMORY;
+        return 1;
+    }
+    arenaReset(arena); // O(1): the previous document's memory is reused as is
+    result->arena = arena;
+    c->opts = opts;
+    c->result = result;
+    c->arena = arena;
+    c->labels.arena = arena;
+    c->nextNum = 1;
+    c->firstChange = -1;
+    c->stats = opts->stats ? &result->stats : NULL;
+    return opts->report ? startReport(result, arena) : 0;
+}
+
+// Sort a block of full entries by new number, in time linear in its length.
+// The new numbers of all full entries are 1..N, each used once, so when a
+// block's numbers are not spread much wider than the block itself each entry
+// is simply put in its place; otherwise they are radix sorted a byte at a time.
+static int sortBlock(Arena *a, FullEntry **block, int k) {
+    if (k < 2) return 0;
+    int lo = block[0]->newNum, hi = lo;
+    for (int e = 1; e < k; e++) {
+        if (block[e]->newNum < lo) lo = block[e]->newNum;
+        if (block[e]->newNum > hi) hi = block[e]->newNum;
+    }
+    size_t range = (size_t)(hi - lo) + 1;
+    if (range <= 4 * (size_t)k) {
+        FullEntry **place = arenaAlloc(a, range * sizeof(*place));
+        if (!place) return -1;
+        memset(place, 0, range * sizeof(*place));
+        for (int e = 0; e < k; e++) place[block[e]->newNum - lo] = block[e];
+        int n = 0;
+        for (size_t r = 0; r < range; r++) {
+            if (place[r]) block[n++] = place[r];
+        }
+        return 0;
+    }
+    FullEntry **from = block, **to = arenaAlloc(a, (size_t)k * sizeof(*to));
+    if (!to) return -1;
+    for (int shift = 0; shift < 32 && ((unsigned)(hi - lo) >> shift) != 0; shift += 8) {
+        int start[257] = { 0 };
+        for (int e = 0; e < k; e++) start[((unsigned)(from[e]->newNum - lo) >> shift & 255) + 1]++;
+        for (int d = 0; d < 256; d++) start[d + 1] += start[d];
+        for (int e = 0; e < k; e++) to[start[(unsigned)(from[e]->newNum - lo) >> shift & 255]++] = from[e];
+        FullEntry **swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != block) memcpy(block, from, (size_t)k * sizeof(*block));
+    return 0;
+}
+
+// Streaming mode
+// --------------
+// For inputs too large to keep in memory the file is read three times, a
+// buffer of whole lines at a time: once for the full entries, once for the
+// in-text citations (which need every full entry to be known), and once to
+// write the result. Only the per-label state is kept between passes.
+
+#ifdef _WIN32
+#define seekFile _fseeki64
+#define tellFile _ftelli64
+#else
+#define seekFile fseeko
+#define tellFile ftello
+#endif
+
+typedef struct {
+    FILE *f;
+    Arena *arena;
+    char *buf;
+    size_t cap;
+    size_t start;     // first byte not yet handed out as a line
+    size_t end;       // end of the data in buf
+    long long base;   // file offset of buf[0]
+    int eof;
+} LineReader;
+
+static void rewindReader(LineReader *r) {
+    rewind(r->f);
+    r->start = r->end = 0;
+    r->base = 0;
+    r->eof = 0;
+}
+
+// Refill the buffer, keeping the unfinished line at its start. Lines handed
+// out before are invalidated. Returns 1 if there is more to read, 0 at the end
+// of the file, -1 on error.
+static int fillReader(LineReader *r) {
+    if (r->eof && r->start == r->end) return 0;
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->base += (long long)r->start;
+    r->end -= r->start;
+    r->start = 0;
+    if (r->end == r->cap) {
+        // a single line fills the whole buffer
+        char *grown = arenaGrow(r->arena, r->buf, r->cap, r->cap * 2);
+        if (!grown) return -1;
+        r->buf = grown;
+        r->cap *= 2;
+    }
+    size_t n = fread(r->buf + r->end, 1, r->cap - r->end, r->f);
+    if (n == 0) {
+        if (ferror(r->f)) return -1;
+        r->eof = 1;
+    }
+    r->end += n;
+    return r->start < r->end ? 1 : 0;
+}
+
+// Hand out the next whole line in the buffer (the last line of the file may
+// lack a '\n'). Returns 0 when the buffer must be refilled first.
+static int nextLine(LineReader *r, Line *line) {
+    const char *s = r->buf + r->start;
+    const char *nl = memchr(s, '\n', r->end - r->start);
+    if (!nl && !(r->eof && r->start < r->end)) return 0;
+    size_t len = nl ? (size_t)(nl + 1 - s) : r->end - r->start;
+    line->text = s;
+    line->len = len;
+    r->start += len;
+    return 1;
+}
+
+// Where a full-entry line is in the file, for writing its block out of order
+typedef struct {
+    long long offset;
+    size_t len;
+    unsigned start, end;   // the definition token's start and end
+    int newline;           // the line ends with '\n'
+} DefLine;
+
+// Write len bytes at offset of f to out, leaving f's position where it was
+static int copyRange(FILE *f, long long offset, size_t len, FILE *out) {
+    char chunk[65536];
+    long long pos = tellFile(f);
+    if (pos < 0 || seekFile(f, offset, SEEK_SET) != 0) return -1;
+    while (len > 0) {
+        size_t n = fread(chunk, 1, len < sizeof(chunk) ? len : sizeof(chunk), f);
+        if (n == 0 || fwrite(chunk, 1, n, out) != n) return -1;
+        len -= n;
+    }
+    return seekFile(f, pos, SEEK_SET);
+}
+
+// Renumber in bounded memory: the label table, a buffer of lines and the longest line
+int citeorder_stream(FILE *in, const citeorder_opts *opts,
+                     citeorder_open_fn open_output, void *ctx, citeorder_result *result) {
+    Collector c = { 0 };
+    if (prepareResult(result, &c, opts) != 0) return result->status;
+    c.copyLabels = 1;
+    Arena *arena = c.arena;
+
+    LineReader r = { in, arena, arenaAlloc(arena, 1 << 20), 1 << 20, 0, 0, 0, 0 };
+    TokenStream ts = { NULL, 0, 0, arena };
+    DefLine *defs = NULL;
+    int defCap = 0;
+    int *cites = NULL;
+    int citeCap = 0;
+    Output res = { 0 };
+    res.arena = arena;
+    FILE *dest = NULL;
+    int rc, i, fence;
+    Line line;
+    double tick = c.stats ? now() : 0;
+    if (!r.buf) {
+        failErrno(&c, CITEORDER_ERR_NO_MEMORY, "malloc");
+        goto done;
+    }
+
+    // Pass 1: collect full-entry citations
+    // ------------------------------------
+    // (check mode stops at the first label out of order, see OrderCheck)
+    OrderCheck order = { opts->check && !opts->relaxed_duplicates };
+    rewindReader(&r);
+    i = 0;
+    fence = 0;
+    while ((rc = fillReader(&r)) > 0) {
+        while (nextLine(&r, &line)) {
+            ts.count = 0;
+            if (lexLine(&ts, &line, i, &fence) != 0) { failErrno(&c, CITEORDER_ERR_NO_MEMORY, "realloc"); goto done; }
+            for (int t = 0; t < ts.count; t++) {
+                if (outOfOrder(&order, line.text, &ts.toks[t])) {
+                    stopCheck(&c, i);
+                    goto done;
+                }
+            }
+            if (ts.count == 1 && ts.toks[0].type == TOK_DEF) {
+                const Token *tok = &ts.toks[0];
+                if (collectDef(&c, line.text + tok->label, (int)tok->labelLen, i) != 0) goto done;
+                if (reserve(arena, (void **)&defs, &defCap, c.fullCount - 1, sizeof(DefLine)) != 0) {
+                    failErrno(&c, CITEORDER_ERR_NO_MEMORY, "realloc");
+                    goto done;
+                }
+                defs[c.fullCount - 1] = (DefLine){ r.base + (line.text - r.buf), line.len, tok->start, tok->end,
+                                                   line.text[line.len - 1] == '\n' };
+            }
+            i++;
+        }
+    }
+    if (rc < 0) { failErrno(&c, CITEORDER_ERR_IO, "read"); goto done; }
+    if (c.stats) {
+        c.stats->full_entry_time = lap(&tick);
+        c.stats->lines = i;
+        c.stats->full_entries = c.fullCount;
+        c.stats->bytes_in = (size_t)(r.base + (long long)r.start);
+    }
+
+    // Pass 2: collect in-text citations and assign sequential new numbers
+    // -------------------------------------------------------------------
+    rewindReader(&r);
+    QuoteState quotes = { 0, 0, MARK_NONE, MARK_NONE, 0 };
+    long inTexts = 0, stacks = 0;
+    i = 0;
+    fence = 0;
+    while ((rc = fillReader(&r)) > 0) {
+        while (nextLine(&r, &line)) {
+            ts.count = 0;
+            if (lexLine(&ts, &line, i, &fence) != 0) { failErrno(&c, CITEORDER_ERR_NO_MEMORY, "realloc"); goto done; }
+            for (int t = 0; t < ts.count; t++) {
+                if (ts.toks[t].type == TOK_STACK) stacks++;
+                if (ts.toks[t].type != TOK_CITE) continue;
+                if (collectCite(&c, &quotes, &line, &ts.toks[t], i, NULL) != 0) goto done;
+                inTexts++;
+            }
+            advanceQuoteLine(&quotes, &line);
+            i++;
+        }
+    }
+    if (rc < 0) { failErrno(&c, CITEORDER_ERR_IO, "read"); goto done; }
+    if (c.stats) {
+        c.stats->in_text_time = lap(&tick);
+        c.stats->in_texts = inTexts;
+        c.stats->stacks = stacks;
+    }
+    if (finishCollect(&c) != 0) goto done;
+    if (c.stats) c.stats->number_time = lap(&tick);
+    result->changed = c.changed;
+    if (opts->check) goto done;
+
+    dest = open_output(ctx, result);
+    if (!dest) goto done;
+
+    // Pass 3: rewrite, a buffer of lines at a time
+    // --------------------------------------------
+    // the same-line rule is replayed from scratch, and the duplicate label's
+    // citations take the numbers recorded for them in order
+    for (int k = 0; k < c.labels.cap; k++) c.labels.slots[k].lastLine = -1;
+    int dupNext = 0;
+    int feCursor = 0;
+    int blockEnd = 0; // lines before this were written as part of a full-entry block
+    rewindReader(&r);
+    i = 0;
+    fence = 0;
+    while ((rc = fillReader(&r)) > 0) {
+        while (nextLine(&r, &line)) {
+            ts.count = 0;
+            if (lexLine(&ts, &line, i, &fence) != 0) { failErrno(&c, CITEORDER_ERR_NO_MEMORY, "realloc"); goto done; }
+            if (i < blockEnd) {
+                // already written, sorted, with the rest of its block
+            } else if (!c.changed || ts.count == 0 || ts.toks[0].type == TOK_FENCE) {
+                // nothing to renumber (an unchanged document is passed through as is)
+                emitSpan(&res, line.text, line.len);
+            } else if (ts.toks[0].type == TOK_DEF) {
+                // --- block of consecutive full entry lines ---
+                int k = 1;
+                while (feCursor + k < c.fullCount && c.fullEntries[feCursor + k].lineIdx == i + k) k++;
+                FullEntry **block = arenaAlloc(arena, k * sizeof(*block));
+                if (!block) { failErrno(&c, CITEORDER_ERR_NO_MEMORY, "malloc"); goto done; }
+                for (int a = 0; a < k; a++) block[a] = &c.fullEntries[feCursor + a];
+                if (sortBlock(arena, block, k) != 0) { failErrno(&c, CITEORDER_ERR_NO_MEMORY, "malloc"); goto done; }
+                // the lines are read back from the file in sorted order
+                for (int a = 0; a < k; a++) {
+                    const DefLine *d = &defs[block[a] - c.fullEntries];
+                    emitPadding(&res, d->start);
+                    emitMarker(&res, block[a]->newNum, ":");
+                    if (c.stats) c.stats->bytes_out += outputSize(&res) + (d->len - d->end) + !d->newline;
+                    if (flushOutput(&res, dest) != 0 ||
+                        copyRange(in, d->offset + d->end, d->len - d->end, dest) != 0 ||
+                        // Ensure newline
+                        (!d->newline && fputc('\n', dest) == EOF)) {
+                        failErrno(&c, CITEORDER_ERR_IO, "write");
+                        goto done;
+                    }
+                    res.count = 0;
+                    res.textLen = 0;
+                }
+                feCursor += k;
+                blockEnd = i + k;
+            } else {
+    	    	// --- in-text line ---
+                int n = 0;
+                for (int t = 0; t < ts.count; t++) {
+                    const Token *tok = &ts.toks[t];
+                    if (tok->type != TOK_CITE) continue;
+                    LabelSlot *slot = findLabel(&c.labels, c.fullEntries, line.text + tok->label, (int)tok->labelLen);
+                    int num = slot->head != slot->last ? c.dupNums[dupNext++] : c.fullEntries[slot->head].newNum;
+                    if (slot->lastLine != i) {
+                        slot->lastLine = i;
+                        slot->lastLineNum = num;
+                    }
+                    if (reserve(arena, (void **)&cites, &citeCap, n, sizeof(int)) != 0) {
+                        failErrno(&c, CITEORDER_ERR_NO_MEMORY, "realloc");
+                        goto done;
+                    }
+                    cites[n++] = slot->lastLineNum;
+                }
+                updateLineInTexts(&res, &line, ts.toks, ts.count, cites);
+            }
+            i++;
+        }
+        // lines are only valid until the next refill
+        if (c.stats) c.stats->bytes_out += outputSize(&res);
+        if (flushOutput(&res, dest) != 0) { failErrno(&c, CITEORDER_ERR_IO, "write"); goto done; }
+        res.count = 0;
+        res.textLen = 0;
+    }
+    if (rc < 0) { failErrno(&c, CITEORDER_ERR_IO, "read"); goto done; }
+    if (fflush(dest) != 0) failErrno(&c, CITEORDER_ERR_IO, "write");
+    if (c.stats) c.stats->render_time = lap(&tick);
+
+done:
+    // everything else lives in the result's arena
+    return result->status;
+}
+
+// Build the renumbered lines [i, to) from the collected footnotes, walking the
+// token stream alongside them from token t, full entry feCursor and in-text
+// citation inCursor on. Unchanged text is referenced in place and only new
+// numbers are copied. Blocks are sorted in arena; res->failed is set if an
+// allocation fails.
+static void renderLines(const Collector *c, Arena *arena, const LineIndex *idx, const TokenStream *ts, Output *res,
+                        int i, int to, int t, int feCursor, int inCursor) {
+    const Line *lines = idx->lines;
+    FullEntry *fullEntries = c->fullEntries;
+    int *writeNums = c->cites.writeNum;
+    while (i < to){
+        if (t == ts->count || ts->toks[t].line != i || ts->toks[t].type == TOK_FENCE) {
+            // no footnotes here (or inside code block)
+            emitSpan(res, lines[i].text, lines[i].len);
+            while (t < ts->count && ts->toks[t].line == i) t++;
+            i++;
+        } else if (ts->toks[t].type != TOK_DEF) {
+	    	// --- in-text line ---
+            int first = t;
+            int cites = 0;
+            while (t < ts->count && ts->toks[t].line == i) {
+                if (ts->toks[t].type == TOK_CITE) cites++;
+                t++;
+            }
+            beginSpan(res, i);
+       	    updateLineInTexts(res, &lines[i], &ts->toks[first], t - first, &writeNums[inCursor]);
+            endSpan(res);
+            inCursor += cites;
+		    i++;
+        } else {
+            // --- block of consecutive full entry lines ---
+            // every definition token became a full entry, in the same order.
+            // A chunk of a document split across threads may start or end
+            // inside a block, so the whole block is sorted but only its rows
+            // from line i up to `to` are emitted.
+            int b = t;
+            while (b > 0 && ts->toks[b - 1].type == TOK_DEF && ts->toks[b - 1].line == ts->toks[b].line - 1) b--;
+            int first = feCursor - (t - b);
+            int start = ts->toks[b].line;
+            int k = t - b;
+            while (b + k < ts->count && ts->toks[b + k].type == TOK_DEF && ts->toks[b + k].line == start + k) k++;
+            int rows = to - start < k ? to - start : k;
+            FullEntry **block = arenaAlloc(arena, k * sizeof(*block));
+            if (!block) {
+                res->failed = 1;
+                return;
+            }
+            for (int a = 0; a < k; a++) block[a] = &fullEntries[first + a];
+        
+            // Sort block by newNum
+            if (sortBlock(arena, block, k) != 0) {
+                res->failed = 1;
+                return;
+            }
+        
+            // Emit block in order
+            for (int a = i - start; a < rows; a++) {
+                const FullEntry *fe = block[a];
+                beginSpan(res, start + a);
+                const Token *def = &ts->toks[b + (int)(fe - &fullEntries[first])];
+        
+                // Construct updated line
+                const char *orig = lines[fe->lineIdx].text;
+                size_t len = lines[fe->lineIdx].len;
+        
+                // add leading spaces
+                emitPadding(res, def->start);
+
+                // New marker + remainder of original line (after the "]:")
+                emitMarker(res, fe->newNum, ":");
+                emitSpan(res, orig + def->end, len - def->end);
+        
+                // Ensure newline
+                if (len == 0 || orig[len - 1] != '\n') {
+                    emitText(res, "\n", 1);
+                }
+                endSpan(res);
+            }
+            t = b + rows;
+            feCursor = first + rows;
+            i = start + rows;
+        }
+    }
+}
+
+// Build the whole renumbered document
+static int renderDocument(Collector *c, const LineIndex *idx, const TokenStream *ts, Output *res) {
+    renderLines(c, c->arena, idx, ts, res, 0, idx->count, 0, 0, 0);
+    if (res->failed) return failErrno(c, CITEORDER_ERR_NO_MEMORY, "realloc");
+    return 0;
+}
+
+// Collect the in-text citations of a lexed document from token `from` on,
+// with the quote state already at or before that token's line. With prep,
+// which holds one entry per citation from `from` on, qs is not used.
+static int collectCites(Collector *c, const LineIndex *idx, const TokenStream *ts, int from, QuoteState *qs,
+                        const CitePrep *prep) {
+    for (int t = from; t < ts->count; t++) {
+        const Token *tok = &ts->toks[t];
+        if (tok->type != TOK_CITE) continue;
+        if (!prep) seekQuoteState(qs, idx->lines, tok->line);
+        if (collectCite(c, qs, &idx->lines[tok->line], tok, tok->line, prep ? prep++ : NULL) != 0) return 1;
+    }
+    return 0;
+}
+
+// Collect the full entries of a lexed document. Returns 0, or 1 after reporting an error.
+static int collectDefs(Collector *c, const LineIndex *idx, const TokenStream *ts) {
+    for (int t = 0; t < ts->count; t++) {
+        const Token *tok = &ts->toks[t];
+        if (tok->type != TOK_DEF) continue;
+        if (collectDef(c, idx->lines[tok->line].text + tok->label, (int)tok->labelLen, tok->line) != 0) return 1;
+    }
+    return 0;
+}
+
+// Collect the footnotes of a lexed document. Returns 0, or 1 after reporting an error.
+static int collectDocument(Collector *c, const LineIndex *idx, const TokenStream *ts) {
+    double tick = c->stats ? now() : 0;
+
+    // Collect full-entry citations
+    // ----------------------------
+    if (collectDefs(c, idx, ts) != 0) return 1;
+    if (c->stats) c->stats->full_entry_time += lap(&tick);
+
+    // Collect in-text citations and assign sequential new numbers
+    // -----------------------------------------------------------
+    QuoteState quotes = { 0, 0, MARK_NONE, MARK_NONE, 0 };
+    int failed = collectCites(c, idx, ts, 0, &quotes, NULL);
+    if (c->stats) {
+        c->stats->in_text_time += lap(&tick);
+        c->stats->quote_backtracks += quotes.backtracks;
+    }
+    if (failed) return 1;
+    failed = finishCollect(c);
+    if (c->stats) c->stats->number_time += lap(&tick);
+    return failed;
+}
+
+// Give the result an output for the collected footnotes. An unchanged document
+// is passed through as one span; returns 1 if it changed and is still to be
+// rendered, 0 if not, or -1 after reporting an error.
+static int startOutput(Collector *c, const LineIndex *idx, const char *in, size_t len) {
+    citeorder_result *result = c->result;
+    result->changed = c->changed;
+    result->output = arenaAlloc(c->arena, sizeof(Output));
+    if (!result->output) {
+        failErrno(c, CITEORDER_ERR_NO_MEMORY, "malloc");
+        return -1;
+    }
+    memset(result->output, 0, sizeof(Output));
+    result->output->arena = c->arena;
+    if (!c->changed) {
+        emitSpan(result->output, in, len);
+        return 0;
+    }
+    if (c->opts->diff) {
+        result->output->lines = idx->lines;
+        result->output->lineCount = idx->count;
+    }
+    return 1;
+}
+
+// Remember where each collected footnote was and its number, for
+// citeorder_result_report(). Rendering sorts the numbers of a stack in place,
+// so this comes first. Returns 0, or 1 after reporting an error.
+static int buildReport(Collector *c, const LineIndex *idx, const TokenStream *ts) {
+    Report *rep = c->result->report;
+    ReportRow *defs = arenaAlloc(c->arena, (size_t)c->fullCount * sizeof(ReportRow) + 1);
+    ReportRow *cites = arenaAlloc(c->arena, (size_t)c->cites.count * sizeof(ReportRow) + 1);
+    if (!defs || !cites) return failErrno(c, CITEORDER_ERR_NO_MEMORY, "malloc");
+    int d = 0, n = 0;
+    for (int t = 0; t < ts->count; t++) {
+        const Token *tok = &ts->toks[t];
+        ReportRow *row;
+        if (tok->type == TOK_DEF && d < c->fullCount) {
+            row = &defs[d];
+            row->num = c->fullEntries[d++].newNum;
+        } else if (tok->type == TOK_CITE && n < c->cites.count) {
+            row = &cites[n];
+            // a resumed document's writeNums are sorted already; they only
+            // differ from newNum with -d, which never resumes
+            row->num = c->opts->relaxed_duplicates ? c->cites.writeNum[n] : c->cites.newNum[n];
+            n++;
+        } else {
+            continue;
+        }
+        row->label = idx->lines[tok->line].text + tok->label;
+        row->labelLen = (int)tok->labelLen;
+        row->line = tok->line + 1;
+        row->column = (int)tok->start + 1;
+    }
+    rep->defs = defs;
+    rep->defCount = d;
+    rep->cites = cites;
+    rep->citeCount = n;
+    return 0;
+}
+
+// Build the result's output from the collected footnotes
+static int buildOutput(Collector *c, const LineIndex *idx, const TokenStream *ts, const char *in, size_t len) {
+    int rc = startOutput(c, idx, in, len);
+    if (rc <= 0) return rc < 0;
+    return renderDocument(c, idx, ts, c->result->output);
+}
+
+#ifdef HAVE_THREADS
+// Splitting a document across threads
+// -----------------------------------
+// With opts->threads, a large document is cut into chunks of whole lines, one
+// per thread, and each phase runs on every chunk at once, leaving only what
+// depends on order to a sequential step:
+//  - indexing: each chunk counts its lines, then fills its part of the index;
+//  - lexing: a fence toggles whatever the state, so each chunk is lexed as if
+//    it started outside code, and the ones that turn out to start inside a
+//    fence are lexed again once the chunks before them are known;
+//  - full entries: split evenly among the threads, which fill them in and hash
+//    their labels; adding them to the label index stays sequential;
+//  - in-text citations: split the same way, the threads look up their labels
+//    and check their quotes from the last quote mark of the chunk before.
+//    Numbering them in order of appearance is sequential, after which the
+//    threads fill them in and check what changed;
+//  - rendering: split again, by cost rather than bytes, each thread renders
+//    into an output of its own (sorting any block of full entries it shares
+//    with its neighbours by itself), and the outputs are joined.
+// Relaxed duplicates and check mode number the citations as collectCite()
+// always does, since both depend on every citation before.
+
+#define MAX_CHUNKS 64
+#define ROW_COST 256 // a full entry row, emitted out of order, costs about as much to render as this many bytes
+#ifndef CITEORDER_CHUNK_MIN
+#define CITEORDER_CHUNK_MIN (256 * 1024) // smallest chunk worth a thread, in bytes
+#endif
+
+typedef struct {
+    size_t from, to;     // its bytes of the document (whole lines)
+    int lo, hi;          // its lines
+    int fence;           // it starts inside a fence
+    int fenceOut;        // it ends inside one
+    TokenStream ts;      // its tokens, in its worker arena until they are joined
+    int tokBase;         // where they start in the joined stream
+    int defs, cites;     // its full entries and in-text citations
+    int defBase, citeBase; // full entries and in-text citations before it
+    int lastMark;        // last quote mark in its lines
+    int carried;         // last quote mark before it
+    int renderLo;        // first line of share k of the rendering (see renderShares())
+    int renderTok, renderDef, renderCite; // the token, full entry and in-text citation there
+    Output out;
+    int segBase, spanBase;
+    size_t textBase;     // where its output goes in the joined one
+    int failed;          // out of memory
+    // for share k of the full entries and in-text citations (see chunkShare())
+    int badDef;          // first full entry whose label is empty or has a space, or -1
+    int badCite;         // first in-text citation that fails a check, or -1
+    int firstChange;     // first in-text citation renumbered, or -1
+    long backtracks;
+} Chunk;
+
+typedef struct {
+    Collector *c;
+    const char *in;
+    LineIndex idx;
+    TokenStream ts;
+    int defs, cites;     // in the whole document
+    unsigned *hashes;    // of each full entry's label
+    CitePrep *prep;      // for each in-text citation
+    Chunk chunks[MAX_CHUNKS];
+    int count;
+} Split;
+
+typedef void (*ChunkFn)(Split *sp, int k);
+
+typedef struct {
+    ChunkFn fn;
+    Split *sp;
+    int k;
+} ChunkTask;
+
+static void *runChunkTask(void *arg) {
+    ChunkTask *task = arg;
+    task->fn(task->sp, task->k);
+    return NULL;
+}
+
+// Run fn on every chunk at once: chunk 0 on this thread, the others on threads
+// of their own (or after it, if one cannot be started)
+static void runChunks(Split *sp, ChunkFn fn) {
+    pthread_t threads[MAX_CHUNKS];
+    ChunkTask tasks[MAX_CHUNKS];
+    int started[MAX_CHUNKS] = { 0 };
+    for (int k = 1; k < sp->count; k++) {
+        tasks[k] = (ChunkTask){ fn, sp, k };
+        started[k] = pthread_create(&threads[k], NULL, runChunkTask, &tasks[k]) == 0;
+    }
+    fn(sp, 0);
+    for (int k = 1; k < sp->count; k++) {
+        if (started[k]) pthread_join(threads[k], NULL);
+        else fn(sp, k);
+    }
+}
+
+// give a at least n worker arenas, one per chunk. Returns 0, or -1 if out of memory.
+static int workerArenas(Arena *a, int n) {
+    if (a->workerCount >= n) return 0;
+    Arena *grown = realloc(a->workers, (size_t)n * sizeof(Arena));
+    if (!grown) return -1;
+    memset(grown + a->workerCount, 0, (size_t)(n - a->workerCount) * sizeof(Arena));
+    a->workers = grown;
+    a->workerCount = n;
+    return 0;
+}
+
+// thread k's share [*from, *to) of n items
+static void chunkShare(const Split *sp, int n, int k, int *from, int *to) {
+    *from = (int)((long long)n * k / sp->count);
+    *to = (int)((long long)n * (k + 1) / sp->count);
+}
+
+// the n-th TOK_DEF or TOK_CITE of the document, and the chunk it is in
+static const Token *nthToken(const Split *sp, TokenType type, int n, int *chunk) {
+    int j = 0;
+    while (j + 1 < sp->count &&
+           (type == TOK_DEF ? sp->chunks[j + 1].defBase : sp->chunks[j + 1].citeBase) <= n) j++;
+    const Token *tok = sp->ts.toks + sp->chunks[j].tokBase;
+    int seen = type == TOK_DEF ? sp->chunks[j].defBase : sp->chunks[j].citeBase;
+    for (;; tok++) {
+        if (tok->type == type && seen++ == n) break;
+    }
+    if (chunk) *chunk = j;
+    return tok;
+}
+
+// count the lines of a chunk (in hi, until the chunks are laid out)
+static void countChunkLines(Split *sp, int k) {
+    Chunk *ch = &sp->chunks[k];
+    const char *p = sp->in + ch->from;
+    const char *end = sp->in + ch->to;
+    int n = 0;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        p = nl ? nl + 1 : end;
+        n++;
+    }
+    ch->hi = n;
+}
+
+// index the lines of a chunk, as indexLines() would
+static void fillChunkLines(Split *sp, int k) {
+    Chunk *ch = &sp->chunks[k];
+    Line *l = sp->idx.lines + ch->lo;
+    const char *p = sp->in + ch->from;
+    const char *end = sp->in + ch->to;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *next = nl ? nl + 1 : end;
+        l->text = p;
+        l->len = (size_t)(next - p);
+        l++;
+        p = next;
+    }
+}
+
+// lex a chunk from the fence state it starts in
+static void relexChunk(Split *sp, int k) {
+    Chunk *ch = &sp->chunks[k];
+    int fence = ch->fence;
+    ch->ts.count = 0;
+    ch->failed = lexLines(sp->idx.lines, ch->lo, ch->hi, &ch->ts, &fence, NULL, NULL) != 0;
+    ch->fenceOut = fence;
+    ch->defs = ch->cites = 0;
+    for (int t = 0; t < ch->ts.count; t++) {
+        if (ch->ts.toks[t].type == TOK_DEF) ch->defs++;
+        else if (ch->ts.toks[t].type == TOK_CITE) ch->cites++;
+    }
+}
+
+// lex a chunk as if it started outside code, and find its last quote mark
+static void lexChunk(Split *sp, int k) {
+    Chunk *ch = &sp->chunks[k];
+    const Line *lines = sp->idx.lines;
+    relexChunk(sp, k);
+    ch->lastMark = MARK_NONE;
+    for (int i = ch->hi - 1; i >= ch->lo && ch->lastMark == MARK_NONE; i--) {
+        ch->lastMark = backScanForQuote(lines[i].text, 0, lines[i].len);
+    }
+}
+
+// relex a chunk only if it starts inside a fence
+static void fixChunkFence(Split *sp, int k) {
+    if (sp->chunks[k].fence) relexChunk(sp, k);
+}
+
+static void joinChunkTokens(Split *sp, int k) {
+    const Chunk *ch = &sp->chunks[k];
+    if (ch->ts.count) memcpy(sp->ts.toks + ch->tokBase, ch->ts.toks, (size_t)ch->ts.count * sizeof(Token));
+}
+
+// fill in share k of the full entries and hash their labels, and empty share k
+// of the label index
+static void prepChunkDefs(Split *sp, int k) {
+    Collector *c = sp->c;
+    int from, to;
+    chunkShare(sp, c->labels.cap, k, &from, &to);
+    for (int s = from; s < to; s++) c->labels.slots[s].head = -1;
+
+    chunkShare(sp, sp->defs, k, &from, &to);
+    sp->chunks[k].badDef = -1;
+    if (from == to) return;
+    const Token *tok = nthToken(sp, TOK_DEF, from, NULL);
+    for (int j = from; j < to; tok++) {
+        if (tok->type != TOK_DEF) continue;
+        FullEntry *fe = &c->fullEntries[j];
+        fe->label = sp->idx.lines[tok->line].text + tok->label;
+        fe->labelLen = (int)tok->labelLen;
+        fe->labelNum = labelNumber(fe->label, fe->labelLen);
+        fe->lineIdx = tok->line;
+        fe->newNum = 0;
+        fe->nextSame = -1;
+        sp->hashes[j] = hashLabel(fe->label, fe->labelLen);
+        if (sp->chunks[k].badDef < 0 && (fe->labelLen == 0 || hasSpace(fe->label, fe->labelLen))) {
+            sp->chunks[k].badDef = j;
+        }
+        j++;
+    }
+}
+
+// Collect the full entries, as collectDefs() would: filled in by the threads,
+// then added to a label index made big enough for all of them, in order.
+// Returns 0, or 1 after reporting an error.
+static int collectChunkDefs(Collector *c, Split *sp) {
+    int cap = 256;
+    while (cap < 2 * (sp->defs + 1)) cap *= 2;
+    c->fullEntries = arenaAlloc(c->arena, (size_t)sp->defs * sizeof(FullEntry));
+    c->labels.slots = arenaAlloc(c->arena, (size_t)cap * sizeof(LabelSlot));
+    sp->hashes = arenaAlloc(c->arena, (size_t)sp->defs * sizeof(unsigned));
+    if (!c->fullEntries || !c->labels.slots || !sp->hashes) return failErrno(c, CITEORDER_ERR_NO_MEMORY, "malloc");
+    c->fullCap = sp->defs;
+    c->labels.cap = cap;
+    runChunks(sp, prepChunkDefs);
+
+    int bad = sp->defs;
+    for (int k = sp->count - 1; k >= 0; k--) {
+        if (sp->chunks[k].badDef >= 0) bad = sp->chunks[k].badDef;
+    }
+    for (int j = 0; j < sp->defs; j++) {
+        FullEntry *fe = &c->fullEntries[j];
+        LabelSlot *slot = probeLabel(&c->labels, c->fullEntries, fe->label, fe->labelLen, sp->hashes[j]);
+        if (j == bad || slot->head >= 0) {
+            // the first error: let collectDef() report it
+            return collectDef(c, fe->label, fe->labelLen, fe->lineIdx);
+        }
+        slot->hash = sp->hashes[j];
+        slot->id = c->labels.count;
+        slot->head = slot->last = slot->cursor = j;
+        slot->lastLine = -1;
+        c->labels.count++;
+        c->fullCount++;
+    }
+    return 0;
+}
+
+// look up the labels of share k of the in-text citations and check their
+// quotes, as collectCites() would. The label index is only read.
+static void prepChunkCites(Split *sp, int k) {
+    const Collector *c = sp->c;
+    const Line *lines = sp->idx.lines;
+    int from, to, j;
+    chunkShare(sp, sp->cites, k, &from, &to);
+    sp->chunks[k].badCite = -1;
+    sp->chunks[k].backtracks = 0;
+    if (from == to) return;
+
+    // start from the quote state of the chunk holding the first citation
+    const Token *tok = nthToken(sp, TOK_CITE, from, &j);
+    QuoteState qs = { sp->chunks[j].lo, 0, MARK_NONE, sp->chunks[j].carried, 0 };
+    for (int n = from; n < to; tok++) {
+        if (tok->type != TOK_CITE) continue;
+        const Line *line = &lines[tok->line];
+        const char *label = line->text + tok->label;
+        int labelLen = (int)tok->labelLen;
+        CitePrep *prep = &sp->prep[n];
+        prep->slot = findLabel(&c->labels, c->fullEntries, label, labelLen);
+        prep->quoted = 1;
+        if (!c->opts->relaxed_quotes) {
+            seekQuoteState(&qs, lines, tok->line);
+            prep->quoted = hasProperQuoteContext(&qs, line->text, tok->start);
+        }
+        if (sp->chunks[k].badCite < 0 &&
+            (labelLen == 0 || hasSpace(label, labelLen) || !prep->slot || !prep->quoted)) {
+            sp->chunks[k].badCite = n;
+        }
+        n++;
+    }
+    sp->chunks[k].backtracks = qs.backtracks;
+}
+
+// fill in share k of the in-text citations once they are numbered, as
+// collectCite() would, and find the first one that was renumbered
+static void fillChunkCites(Split *sp, int k) {
+    const Collector *c = sp->c;
+    int from, to;
+    chunkShare(sp, sp->cites, k, &from, &to);
+    sp->chunks[k].firstChange = -1;
+    if (from == to) return;
+    const Token *tok = nthToken(sp, TOK_CITE, from, NULL);
+    for (int n = from; n < to; tok++) {
+        if (tok->type != TOK_CITE) continue;
+        const FullEntry *entry = &c->fullEntries[sp->prep[n].slot->head];
+        c->cites.line[n]     = tok->line;
+        c->cites.newNum[n]   = entry->newNum;
+        c->cites.writeNum[n] = entry->newNum; // a label has one number without relaxed duplicates
+        if (sp->chunks[k].firstChange < 0 && entry->labelNum != entry->newNum) {
+            sp->chunks[k].firstChange = n;
+        }
+        n++;
+    }
+}
+
+// Collect the in-text citations, as collectCites() would: checked by the
+// threads, numbered in order, then filled in by the threads.
+// Returns 0, or 1 after reporting an error.
+static int collectChunkCites(Collector *c, Split *sp) {
+    int bad = sp->cites;
+    for (int k = sp->count - 1; k >= 0; k--) {
+        if (sp->chunks[k].badCite >= 0) bad = sp->chunks[k].badCite;
+    }
+    for (int n = 0; n < bad; n++) {
+        FullEntry *entry = &c->fullEntries[sp->prep[n].slot->head];
+        if (entry->newNum == 0) entry->newNum = c->nextNum++;
+    }
+    if (bad < sp->cites) {
+        // the first error: let collectCite() report it
+        const Token *tok = nthToken(sp, TOK_CITE, bad, NULL);
+        return collectCite(c, NULL, &sp->idx.lines[tok->line], tok, tok->line, &sp->prep[bad]);
+    }
+
+    if (growCites(c->arena, &c->cites, sp->cites) != 0) return failErrno(c, CITEORDER_ERR_NO_MEMORY, "malloc");
+    c->cites.count = sp->cites;
+    runChunks(sp, fillChunkCites);
+    for (int k = 0; k < sp->count && c->firstChange < 0; k++) c->firstChange = sp->chunks[k].firstChange;
+    c->changed = c->firstChange >= 0;
+    return 0;
+}
+
+// the cost of rendering lines [0, i), and the full entries on them
+static size_t renderCost(const Split *sp, int i, int *defs) {
+    const FullEntry *fe = sp->c->fullEntries;
+    int lo = 0, hi = sp->c->fullCount;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (fe[mid].lineIdx < i) lo = mid + 1;
+        else hi = mid;
+    }
+    *defs = lo;
+    size_t bytes = i < sp->idx.count ? (size_t)(sp->idx.lines[i].text - sp->in) : sp->chunks[sp->count - 1].to;
+    return bytes + (size_t)ROW_COST * (size_t)lo;
+}
+
+// Share out the rendering by cost, so that blocks of full entries (slow per
+// byte) are spread over more threads than the text around them
+static void renderShares(Split *sp) {
+    size_t total = renderCost(sp, sp->idx.count, &sp->chunks[0].renderDef);
+    for (int k = 0; k < sp->count; k++) {
+        Chunk *ch = &sp->chunks[k];
+        size_t target = (size_t)((double)total * k / sp->count);
+        int lo = k ? sp->chunks[k - 1].renderLo : 0, hi = sp->idx.count;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (renderCost(sp, mid, &ch->renderDef) < target) lo = mid + 1;
+            else hi = mid;
+        }
+        ch->renderLo = lo;
+        renderCost(sp, lo, &ch->renderDef);
+        int t = 0, n = sp->ts.count;
+        while (t < n) {
+            int mid = t + (n - t) / 2;
+            if (sp->ts.toks[mid].line < lo) t = mid + 1;
+            else n = mid;
+        }
+        ch->renderTok = t;
+        int in = 0;
+        n = sp->c->cites.count;
+        while (in < n) {
+            int mid = in + (n - in) / 2;
+            if (sp->c->cites.line[mid] < lo) in = mid + 1;
+            else n = mid;
+        }
+        ch->renderCite = in;
+    }
+}
+
+static void renderChunk(Split *sp, int k) {
+    Chunk *ch = &sp->chunks[k];
+    int to = k + 1 < sp->count ? sp->chunks[k + 1].renderLo : sp->idx.count;
+    memset(&ch->out, 0, sizeof(Output));
+    ch->out.arena = &sp->c->arena->workers[k];
+    ch->out.lines = sp->c->result->output->lines;
+    renderLines(sp->c, ch->out.arena, &sp->idx, &sp->ts, &ch->out, ch->renderLo, to,
+                ch->renderTok, ch->renderDef, ch->renderCite);
+}
+
+static void joinChunkOutput(Split *sp, int k) {
+    const Chunk *ch = &sp->chunks[k];
+    Output *out = sp->c->result->output;
+    Segment *seg = out->segs + ch->segBase;
+    for (int s = 0; s < ch->out.count; s++) {
+        seg[s] = ch->out.segs[s];
+        if (!seg[s].src) seg[s].off += ch->textBase;
+    }
+    if (ch->out.textLen) memcpy(out->text + ch->textBase, ch->out.text, ch->out.textLen);
+    LineSpan *span = out->spans + ch->spanBase;
+    for (int s = 0; s < ch->out.spanCount; s++) {
+        span[s] = ch->out.spans[s];
+        span[s].seg += ch->segBase;
+        span[s].endSeg += ch->segBase;
+    }
+}
+
+// citeorder_process() over count chunks of the document at once
+static int processChunks(Collector *c, const char *in, size_t len, int count) {
+    Split sp = { 0 };
+    Arena *arena = c->arena;
+    Chunk *chunks = sp.chunks;
+    double tick = c->stats ? now() : 0;
+    if (workerArenas(arena, count) != 0) return failErrno(c, CITEORDER_ERR_NO_MEMORY, "malloc");
+    sp.c = c;
+    sp.in = in;
+    sp.count = count;
+
+    // Index: chunks end just past a '\n'
+    // ---------------------------------
+    for (int k = 0; k < count; k++) {
+        Chunk *ch = &chunks[k];
+        ch->from = k ? chunks[k - 1].to : 0;
+        ch->to = len;
+        size_t at = len / (size_t)count * (size_t)(k + 1);
+        if (k + 1 < count && at >= ch->from) {
+            const char *nl = memchr(in + at, '\n', len - at);
+            if (nl) ch->to = (size_t)(nl + 1 - in);
+        } else if (k + 1 < count) {
+            ch->to = ch->from;
+        }
+        ch->ts = (TokenStream){ NULL, 0, 0, &arena->workers[k] };
+    }
+    runChunks(&sp, countChunkLines);
+    int lineCount = 0;
+    for (int k = 0; k < count; k++) {
+        chunks[k].lo = lineCount;
+        lineCount += chunks[k].hi;
+        chunks[k].hi = lineCount;
+    }
+    sp.idx.lines = arenaAlloc(arena, (size_t)lineCount * sizeof(Line));
+    if (!sp.idx.lines) return failErrno(c, CITEORDER_ERR_NO_MEMORY, "malloc");
+    sp.idx.count = sp.idx.cap = lineCount;
+    runChunks(&sp, fillChunkLines);
+    if (c->stats) c->stats->index_time = lap(&tick);
+
+    // Lex, then again where a chunk starts inside a fence
+    // ---------------------------------------------------
+    runChunks(&sp, lexChunk);
+    int fence = 0, relex = 0;
+    for (int k = 0; k < count; k++) {
+        int toggled = chunks[k].fenceOut;
+        chunks[k].fence = fence;
+        relex |= fence;
+        fence ^= toggled;
+    }
+    if (relex) runChunks(&sp, fixChunkFence);
+    int tokens = 0, mark = MARK_NONE, failed = 0;
+    for (int k = 0; k < count; k++) {
+        Chunk *ch = &chunks[k];
+        failed |= ch->failed;
+        ch->tokBase = tokens;
+        ch->defBase = sp.defs;
+        ch->citeBase = sp.cites;
+        ch->carried = mark;
+        tokens += ch->ts.count;
+        sp.defs += ch->defs;
+        sp.cites += ch->cites;
+        if (ch->lastMark != MARK_NONE) mark = ch->lastMark;
+    }
+    sp.ts = (TokenStream){ arenaAlloc(arena, (size_t)tokens * sizeof(Token)), tokens, tokens, arena };
+    if (failed || !sp.ts.toks) return failErrno(c, CITEORDER_ERR_NO_MEMORY, "realloc");
+    runChunks(&sp, joinChunkTokens);
+    if (c->stats) c->stats->lex_time = lap(&tick);
+
+    // Collect full entries, then in-text citations
+    // --------------------------------------------
+    int ordered = c->opts->relaxed_duplicates || c->opts->check;
+    failed = ordered ? collectDefs(c, &sp.idx, &sp.ts) : collectChunkDefs(c, &sp);
+    if (c->stats) c->stats->full_entry_time = lap(&tick);
+    if (!failed && !c->opts->check) {
+        // (check mode likely stops at one of the first citations)
+        sp.prep = arenaAlloc(arena, (size_t)sp.cites * sizeof(CitePrep));
+        if (!sp.prep) return failErrno(c, CITEORDER_ERR_NO_MEMORY, "malloc");
+        runChunks(&sp, prepChunkCites);
+    }
+    if (!failed) {
+        QuoteState quotes = { 0, 0, MARK_NONE, MARK_NONE, 0 };
+        failed = ordered ? collectCites(c, &sp.idx, &sp.ts, 0, &quotes, sp.prep) : collectChunkCites(c, &sp);
+        if (c->stats) {
+            c->stats->in_text_time = lap(&tick);
+            c->stats->quote_backtracks = quotes.backtracks;
+            for (int k = 0; k < count && sp.prep; k++) c->stats->quote_backtracks += chunks[k].backtracks;
+        }
+    }
+    if (!failed) {
+        failed = finishCollect(c);
+        if (c->stats) c->stats->number_time = lap(&tick);
+    }
+    if (!failed && !c->opts->check && c->opts->report) failed = buildReport(c, &sp.idx, &sp.ts);
+
+    // Render
+    // ------
+    if (!failed && !c->opts->check && startOutput(c, &sp.idx, in, len) == 1) {
+        renderShares(&sp);
+        runChunks(&sp, renderChunk);
+        Output *out = c->result->output;
+        size_t text = 0;
+        int segs = 0, spans = 0;
+        for (int k = 0; k < count; k++) {
+            Chunk *ch = &chunks[k];
+            failed |= ch->out.failed;
+            ch->segBase = segs;
+            ch->textBase = text;
+            ch->spanBase = spans;
+            segs += ch->out.count;
+            text += ch->out.textLen;
+            spans += ch->out.spanCount;
+        }
+        out->segs = arenaAlloc(arena, (size_t)segs * sizeof(Segment));
+        out->text = arenaAlloc(arena, text);
+        out->spans = arenaAlloc(arena, (size_t)spans * sizeof(LineSpan));
+        if (failed || !out->segs || !out->text || !out->spans) return failErrno(c, CITEORDER_ERR_NO_MEMORY, "realloc");
+        out->count = out->cap = segs;
+        out->textLen = out->textCap = text;
+        out->spanCount = out->spanCap = spans;
+        runChunks(&sp, joinChunkOutput);
+        if (c->stats) c->stats->render_time = lap(&tick);
+    }
+    if (c->stats) countStats(c->stats, c, &sp.idx, &sp.ts, len);
+    return c->result->status;
+}
+#endif
+
+#define CHECK_BATCH (256 * 1024) // bytes of lines check mode indexes and lexes at a time
+
+// Check mode: index and lex the document a batch of lines at a time, stopping
+// at the first label out of order (see OrderCheck). Returns 0 once it is all
+// lexed, 1 if it stopped there (having reported the change), or -1 if out of memory.
+static int lexUntilOutOfOrder(Collector *c, LineIndex *idx, TokenStream *ts, const char *in, size_t len) {
+    OrderCheck oc = { c->opts->relaxed_duplicates ? 0 : 1 };
+    int fence = 0;
+    double tick = c->stats ? now() : 0;
+    for (size_t at = 0; at < len; ) {
+        size_t to = len;
+        if (len - at > CHECK_BATCH) {
+            const char *nl = memchr(in + at + CHECK_BATCH, '\n', len - at - CHECK_BATCH);
+            if (nl) to = (size_t)(nl + 1 - in);
+        }
+        int fromLine = idx->count, fromTok = ts->count;
+        if (indexLines(c->arena, idx, in + at, to - at) != 0) return -1;
+        if (c->stats) c->stats->index_time += lap(&tick);
+        if (lexLines(idx->lines, fromLine, idx->count, ts, &fence, NULL, NULL) != 0) return -1;
+        for (int t = fromTok; t < ts->count; t++) {
+            const Token *tok = &ts->toks[t];
+            if (outOfOrder(&oc, idx->lines[tok->line].text, tok)) return stopCheck(c, tok->line);
+        }
+        if (c->stats) c->stats->lex_time += lap(&tick);
+        at = to;
+    }
+    return 0;
+}
+
+int citeorder_process(const char *in, size_t len, const citeorder_opts *opts, citeorder_result *result) {
+    Collector c = { 0 };
+    if (prepareResult(result, &c, opts) != 0) return result->status;
+    c.keepCites = 1;
+
+#ifdef HAVE_THREADS
+    int chunks = opts->threads < MAX_CHUNKS ? opts->threads : MAX_CHUNKS;
+    if ((size_t)chunks > len / CITEORDER_CHUNK_MIN) chunks = (int)(len / CITEORDER_CHUNK_MIN);
+    if (chunks > 1) return processChunks(&c, in, len, chunks);
+#endif
+    LineIndex idx = { NULL, 0, 0 }; // zero-copy views into in
+    TokenStream ts = { NULL, 0, 0, c.arena };
+    double tick = c.stats ? now() : 0;
+
+    // Tokenize once; every phase below works from the token stream
+    // -------------------------------------------------------------
+    int failed;
+    if (opts->check) {
+        failed = lexUntilOutOfOrder(&c, &idx, &ts, in, len);
+        if (failed == 1) {
+            if (c.stats) countStats(c.stats, &c, &idx, &ts, len);
+            return result->status;
+        }
+    } else {
+        failed = indexLines(c.arena, &idx, in, len);
+        if (c.stats) c.stats->index_time = lap(&tick);
+        if (!failed) {
+            failed = lexDocument(idx.lines, idx.count, &ts);
+            if (c.stats) c.stats->lex_time = lap(&tick);
+        }
+    }
+    if (failed) {
+        failErrno(&c, CITEORDER_ERR_NO_MEMORY, "realloc");
+    } else if (collectDocument(&c, &idx, &ts) == 0 && !opts->check) {
+        if (c.stats) tick = now();
+        if (!opts->report || buildReport(&c, &idx, &ts) == 0) buildOutput(&c, &idx, &ts, in, len);
+        if (c.stats) c.stats->render_time = lap(&tick);
+    }
+    if (c.stats) countStats(c.stats, &c, &idx, &ts, len);
+    return result->status;
+}
+
+// join the segments of out into one NUL-terminated buffer from its arena
+static char *joinOutput(const Output *out, size_t *len) {
+    size_t total = 0;
+    for (int k = 0; k < out->count; k++) total += out->segs[k].len;
+    char *joined = arenaAlloc(out->arena, total + 1);
+    if (!joined) return NULL;
+    char *p = joined;
+    for (int k = 0; k < out->count; k++) {
+        const Segment *seg = &out->segs[k];
+        memcpy(p, seg->src ? seg->src : out->text + seg->off, seg->len);
+        p += seg->len;
+    }
+    *p = '\0';
+    *len = total;
+    return joined;
+}
+
+const char *citeorder_result_text(citeorder_result *result, size_t *len) {
+    Output *out = result->output;
+    if (!out || result->status != CITEORDER_OK) return NULL;
+    if (!out->joined && !(out->joined = joinOutput(out, &out->joinedLen))) return NULL;
+    if (len) *len = out->joinedLen;
+    return out->joined;
+}
+
+// The bytes of the output a span covers, piece by piece: call with *k = sp->seg
+// until it returns NULL
+static const char *spanPiece(const Output *out, const LineSpan *sp, int *k, size_t *len) {
+    for (; *k <= sp->endSeg && *k < out->count; (*k)++) {
+        const Segment *seg = &out->segs[*k];
+        size_t from = *k == sp->seg ? sp->off : 0;
+        size_t to = *k == sp->endSeg ? sp->endOff : seg->len;
+        if (to <= from) continue;
+        *len = to - from;
+        (*k)++;
+        return (seg->src ? seg->src : out->text + seg->off) + from;
+    }
+    return NULL;
+}
+
+// whether the rewritten line differs from the input line
+static int spanChanged(const Output *out, const LineSpan *sp) {
+    const Line *line = &out->lines[sp->line];
+    size_t pos = 0, len;
+    int k = sp->seg;
+    const char *p;
+    while ((p = spanPiece(out, sp, &k, &len)) != NULL) {
+        if (pos + len > line->len || memcmp(line->text + pos, p, len) != 0) return 1;
+        pos += len;
+    }
+    return pos != line->len;
+}
+
+// end a diff line that has no newline of its own
+static void emitNoNewline(Output *diff) {
+    static const char noNewline[] = "\n\\ No newline at end of file\n";
+    emitText(diff, noNewline, sizeof(noNewline) - 1);
+}
+
+// one line of a diff: its prefix, then the text
+static void emitDiffLine(Output *diff, char prefix, const char *text, size_t len) {
+    emitText(diff, &prefix, 1);
+    emitText(diff, text, len);
+    if (len == 0 || text[len - 1] != '\n') emitNoNewline(diff);
+}
+
+// " -start,count" of a hunk header (the count is left out when it is 1)
+static void emitRange(Output *diff, char sign, int start, int count) {
+    char buf[16];
+    emitText(diff, &sign, 1);
+    char *digits = formatNumber(buf, sizeof(buf), start);
+    emitText(diff, digits, (size_t)(buf + sizeof(buf) - digits));
+    if (count != 1) {
+        emitText(diff, ",", 1);
+        digits = formatNumber(buf, sizeof(buf), count);
+        emitText(diff, digits, (size_t)(buf + sizeof(buf) - digits));
+    }
+}
+
+#define DIFF_CONTEXT 3
+
+const char *citeorder_result_diff(citeorder_result *result, const char *name, size_t *len) {
+    Output *out = result->output;
+    if (!out || result->status != CITEORDER_OK) return NULL;
+    Output diff = { 0 };
+    diff.arena = out->arena;
+
+    // Only the rewritten lines can differ; the rest of the output is the input
+    // line for line, so hunks come straight from the spans
+    int *changed = NULL;
+    int count = 0;
+    if (out->spanCount > 0) {
+        changed = arenaAlloc(out->arena, (size_t)out->spanCount * sizeof(*changed));
+        if (!changed) return NULL;
+    }
+    for (int s = 0; s < out->spanCount; s++) {
+        if (spanChanged(out, &out->spans[s])) changed[count++] = s;
+    }
+
+    if (count > 0) {
+        emitText(&diff, "--- a/", 6);
+        emitText(&diff, name, strlen(name));
+        emitText(&diff, "\n+++ b/", 7);
+        emitText(&diff, name, strlen(name));
+        emitText(&diff, "\n", 1);
+    }
+    for (int h = 0; h < count; ) {
+        // extend the hunk while the next change is within reach of its context
+        int last = h;
+        while (last + 1 < count &&
+               out->spans[changed[last + 1]].line - out->spans[changed[last]].line <= 2 * DIFF_CONTEXT + 1) {
+            last++;
+        }
+        int from = out->spans[changed[h]].line - DIFF_CONTEXT;
+        int to = out->spans[changed[last]].line + DIFF_CONTEXT + 1;
+        if (from < 0) from = 0;
+        if (to > out->lineCount) to = out->lineCount;
+
+        emitText(&diff, "@@ ", 3);
+        emitRange(&diff, '-', from + 1, to - from);
+        emitText(&diff, " ", 1);
+        emitRange(&diff, '+', from + 1, to - from);
+        emitText(&diff, " @@\n", 4);
+
+        int line = from;
+        while (line < to) {
+            if (h > last || out->spans[changed[h]].line != line) {
+                emitDiffLine(&diff, ' ', out->lines[line].text, out->lines[line].len);
+                line++;
+                continue;
+            }
+            // a run of changed lines: the old ones, then the new ones
+            int run = h;
+            while (run + 1 <= last && out->spans[changed[run + 1]].line == out->spans[changed[run]].line + 1) run++;
+            for (int r = h; r <= run; r++) {
+                const Line *old = &out->lines[out->spans[changed[r]].line];
+                emitDiffLine(&diff, '-', old->text, old->len);
+            }
+            for (int r = h; r <= run; r++) {
+                const LineSpan *sp = &out->spans[changed[r]];
+                const char *p, *tail = NULL;
+                size_t n, tailLen = 0;
+                int k = sp->seg;
+                emitText(&diff, "+", 1);
+                while ((p = spanPiece(out, sp, &k, &n)) != NULL) {
+                    emitText(&diff, p, n);
+                    tail = p;
+                    tailLen = n;
+                }
+                if (tailLen == 0 || tail[tailLen - 1] != '\n') emitNoNewline(&diff);
+            }
+            line += run - h + 1;
+            h = run + 1;
+        }
+    }
+    if (diff.failed) return NULL;
+
+    size_t total;
+    char *text = joinOutput(&diff, &total);
+    if (text && len) *len = total;
+    return text;
+}
+
+int citeorder_result_edits(citeorder_result *result, const citeorder_edit **edits) {
+    Output *out = result->output;
+    *edits = NULL;
+    if (!out || result->status != CITEORDER_OK) return -1;
+    if (out->spanCount == 0) return 0;
+    citeorder_edit *list = arenaAlloc(out->arena, (size_t)out->spanCount * sizeof(citeorder_edit));
+    if (!list) return -1;
+
+    // like the diff, edits come straight from the rewritten lines
+    const char *base = out->lines[0].text;
+    int count = 0;
+    for (int s = 0; s < out->spanCount; s++) {
+        const LineSpan *sp = &out->spans[s];
+        const Line *line = &out->lines[sp->line];
+        const char *p;
+        size_t total = 0, n;
+        int k = sp->seg;
+        while ((p = spanPiece(out, sp, &k, &n)) != NULL) total += n;
+        char *text = arenaAlloc(out->arena, total + 1);
+        if (!text) return -1;
+        size_t at = 0;
+        k = sp->seg;
+        while ((p = spanPiece(out, sp, &k, &n)) != NULL) {
+            memcpy(text + at, p, n);
+            at += n;
+        }
+        // only what lies between the common prefix and suffix changed
+        size_t pre = 0, suf = 0;
+        while (pre < total && pre < line->len && text[pre] == line->text[pre]) pre++;
+        while (suf < total - pre && suf < line->len - pre && text[total - 1 - suf] == line->text[line->len - 1 - suf]) suf++;
+        if (pre == total && pre == line->len) continue;
+        size_t start = (size_t)(line->text - base);
+        list[count++] = (citeorder_edit){ start + pre, start + line->len - suf, text + pre, total - pre - suf };
+    }
+    *edits = list;
+    return count;
+}
+
+const char *citeorder_status_name(citeorder_status status) {
+    static const char *names[] = { "ok", "missing_label", "label_space", "duplicate", "multiple_duplicates",
+                                   "unequal_duplicates", "missing_entry", "quote", "no_memory", "io" };
+    return (unsigned)status < sizeof(names) / sizeof(names[0]) ? names[status] : "unknown";
+}
+
+// the len bytes at s as a JSON string
+static void emitJsonString(Output *out, const char *s, size_t len) {
+    emitText(out, "\"", 1);
+    size_t from = 0;
+    for (size_t k = 0; k < len; k++) {
+        unsigned char ch = (unsigned char)s[k];
+        if (ch != '"' && ch != '\\' && ch >= 0x20) continue;
+        char esc[8];
+        int n = ch >= 0x20 ? snprintf(esc, sizeof(esc), "\\%c", ch) : snprintf(esc, sizeof(esc), "\\u%04x", ch);
+        emitText(out, s + from, k - from);
+        emitText(out, esc, (size_t)n);
+        from = k + 1;
+    }
+    emitText(out, s + from, len - from);
+    emitText(out, "\"", 1);
+}
+
+// ,"key":num
+static void emitJsonNumber(Output *out, const char *key, int num) {
+    char buf[16];
+    char *digits = formatNumber(buf, sizeof(buf), num);
+    emitText(out, ",\"", 2);
+    emitText(out, key, strlen(key));
+    emitText(out, "\":", 2);
+    emitText(out, digits, (size_t)(buf + sizeof(buf) - digits));
+}
+
+// ,"key":[{"label":...,"number":...,"line":...,"column":...},...]
+static void emitReportRows(Output *out, const char *key, const ReportRow *rows, int count) {
+    emitText(out, ",\"", 2);
+    emitText(out, key, strlen(key));
+    emitText(out, "\":[", 3);
+    for (int k = 0; k < count; k++) {
+        emitText(out, k ? ",{\"label\":" : "{\"label\":", k ? 10 : 9);
+        emitJsonString(out, rows[k].label, (size_t)rows[k].labelLen);
+        emitJsonNumber(out, "number", rows[k].num);
+        emitJsonNumber(out, "line", rows[k].line);
+        emitJsonNumber(out, "column", rows[k].column);
+        emitText(out, "}", 1);
+    }
+    emitText(out, "]", 1);
+}
+
+const char *citeorder_result_report(citeorder_result *result, const char *name, size_t *len) {
+    const Report *rep = result->report;
+    if (!rep) return NULL;
+    Output json = { 0 };
+    json.arena = rep->arena;
+    emitText(&json, "{\"file\":", 8);
+    emitJsonString(&json, name, strlen(name));
+    emitText(&json, ",\"status\":", 10);
+    const char *status = citeorder_status_name(result->status);
+    emitJsonString(&json, status, strlen(status));
+    if (result->line > 0) emitJsonNumber(&json, "line", result->line);
+    if (result->status != CITEORDER_OK) {
+        if (result->message) {
+            emitText(&json, ",\"message\":", 11);
+            emitJsonString(&json, result->message, strlen(result->message));
+        }
+        if (result->hint) {
+            emitText(&json, ",\"hint\":", 8);
+            emitJsonString(&json, result->hint, strlen(result->hint));
+        }
+    } else {
+        emitText(&json, result->changed ? ",\"changed\":true" : ",\"changed\":false", result->changed ? 15 : 16);
+    }
+    if (result->status == CITEORDER_OK) {
+        emitReportRows(&json, "definitions", rep->defs, rep->defCount);
+        emitReportRows(&json, "citations", rep->cites, rep->citeCount);
+    }
+    emitText(&json, "}\n", 2);
+    if (json.failed) return NULL;
+
+    size_t total;
+    char *text = joinOutput(&json, &total);
+    if (text && len) *len = total;
+    return text;
+}
+
+int citeorder_result_write(const citeorder_result *result, FILE *f) {
+    if (!result->output || result->status != CITEORDER_OK) {
+        errno = EINVAL;
+        return -1;
+    }
+    return flushOutput(result->output, f);
+}
+
+void citeorder_result_free(citeorder_result *result) {
+    if (result->arena) {
+        arenaFree(result->arena);
+        free(result->arena);
+    }
+    memset(result, 0, sizeof(*result));
+}
+
+// Resident documents
+// ------------------
+// A document kept between edits (watch mode). Each update diffs the new text
+// against the old one, re-lexes only the lines that changed (and any lines
+// after them whose fence state flipped), and resumes collecting from the first
+// citation at or after the edit with the numbering the citations before it
+// left. The new state is built in the spare arena from copies of the old one,
+// then the two swap.
+//
+// Only lexing is edit-sized. The rest still costs time in proportion to the
+// document: the text is compared and copied, the line index, tokens, full
+// entries and label slots are copied (shifted past the edit), the citations
+// from the edit to the end are collected again, and a document that changed
+// is rendered in full. For an edit in the middle of a large document this is
+// about half the time of citeorder_process().
+
+struct citeorder_doc {
+    citeorder_opts opts;
+    Arena arenas[2];         // the current state lives in one, the next update is built in the other
+    int cur;
+    char *text[2];           // the current text and the previous one
+    size_t textCap[2];
+    size_t len;
+    LineIndex idx;
+    TokenStream ts;
+    int *lineTok;            // index of each line's first token, idx.count + 1 entries
+    unsigned char *inFence;  // each line starts inside a fenced code block, idx.count + 1 entries
+    Collector c;
+    int lexed;               // idx, ts, lineTok and inFence describe the current text
+    int collected;           // c holds its footnotes (the last update found no error)
+};
+
+// Append n lines of another text's index: the same bytes, found delta bytes
+// further on in newBase than they were in oldBase
+static int copyLines(Arena *a, LineIndex *idx, const Line *src, int n,
+                     const char *oldBase, const char *newBase, ptrdiff_t delta) {
+    if (idx->count + n > idx->cap) {
+        int cap = idx->count + n + 1024;
+        Line *grown = arenaGrow(a, idx->lines, (size_t)idx->cap * sizeof(*grown), (size_t)cap * sizeof(*grown));
+        if (!grown) return -1;
+        idx->lines = grown;
+        idx->cap = cap;
+    }
+    for (int k = 0; k < n; k++) {
+        idx->lines[idx->count].text = newBase + ((src[k].text - oldBase) + delta);
+        idx->lines[idx->count].len = src[k].len;
+        idx->count++;
+    }
+    return 0;
+}
+
+// first line of idx whose end (start, if ends is 0) is past offset off of base
+static int lineAfter(const LineIndex *idx, const char *base, size_t off, int ends) {
+    int lo = 0, hi = idx->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        size_t at = (size_t)(idx->lines[mid].text - base) + (ends ? idx->lines[mid].len : 0);
+        if (at > off) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+citeorder_doc *citeorder_doc_new(const citeorder_opts *opts) {
+    citeorder_doc *doc = calloc(1, sizeof(*doc));
+    if (doc && opts) doc->opts = *opts;
+    return doc;
+}
+
+void citeorder_doc_free(citeorder_doc *doc) {
+    if (!doc) return;
+    for (int k = 0; k < 2; k++) {
+        arenaFree(&doc->arenas[k]);
+        free(doc->text[k]);
+    }
+    free(doc);
+}
+
+int citeorder_doc_update(citeorder_doc *doc, const char *in, size_t len, citeorder_result *result) {
+    int next = 1 - doc->cur;
+    Arena *a = &doc->arenas[next];
+    arenaReset(a);
+    memset(result, 0, sizeof(*result));
+    Collector c = { 0 };
+    c.opts = &doc->opts;
+    c.result = result;
+    c.arena = a;
+    c.labels.arena = a;
+    c.nextNum = 1;
+    c.firstChange = -1;
+    c.keepCites = 1;
+    c.stats = doc->opts.stats ? &result->stats : NULL;
+    if (doc->opts.report && startReport(result, a) != 0) return result->status;
+    double tick = c.stats ? now() : 0;
+
+    // the previous state stays readable while the next one is built
+    const char *old = doc->text[doc->cur];
+    size_t oldLen = doc->len;
+    int lexed = doc->lexed;
+    int collected = doc->collected;
+    doc->lexed = doc->collected = 0;
+
+    if (len + 1 > doc->textCap[next]) {
+        char *grown = realloc(doc->text[next], len + 1);
+        if (!grown) {
+            failErrno(&c, CITEORDER_ERR_NO_MEMORY, "realloc");
+            return result->status;
+        }
+        doc->text[next] = grown;
+        doc->textCap[next] = len + 1;
+    }
+    char *text = doc->text[next];
+    memcpy(text, in, len);
+    doc->cur = next;
+    doc->len = len;
+
+    LineIndex idx = { NULL, 0, 0 };
+    TokenStream ts = { NULL, 0, 0, a };
+    int *lineTok = NULL;
+    unsigned char *inFence = NULL;
+    int fence = 0;
+    int F = 0, Eo = 0, R = 0, Ro = 0, lineShift = 0;
+    ptrdiff_t delta = (ptrdiff_t)len - (ptrdiff_t)oldLen;
+
+    if (!lexed) {
+        if (indexLines(a, &idx, text, len) != 0) goto nomem;
+        if (c.stats) c.stats->index_time = lap(&tick);
+        lineTok = arenaAlloc(a, (size_t)(idx.count + 1) * sizeof(int));
+        inFence = arenaAlloc(a, (size_t)idx.count + 1);
+        if (!lineTok || !inFence) goto nomem;
+        if (lexLines(idx.lines, 0, idx.count, &ts, &fence, lineTok, inFence) != 0) goto nomem;
+        R = idx.count;
+    } else {
+        const LineIndex *oi = &doc->idx;
+        int oc = oi->count;
+
+        // the bytes both texts start and end with
+        size_t most = len < oldLen ? len : oldLen;
+        size_t pre = 0;
+        while (pre + 4096 <= most && memcmp(old + pre, text + pre, 4096) == 0) pre += 4096;
+        while (pre < most && old[pre] == text[pre]) pre++;
+        size_t suf = 0;
+        while (suf + 4096 <= most - pre &&
+               memcmp(old + oldLen - suf - 4096, text + len - suf - 4096, 4096) == 0) suf += 4096;
+        while (suf < most - pre && old[oldLen - 1 - suf] == text[len - 1 - suf]) suf++;
+
+        // lines [0, F) are unchanged, and so are old lines from Eo on, which start
+        // (after a '\n') within the common end; an unterminated last line may grow
+        F = lineAfter(oi, old, pre, 1);
+        if (F > 0 && F == oc && oi->lines[F - 1].text[oi->lines[F - 1].len - 1] != '\n') F--;
+        Eo = lineAfter(oi, old, oldLen - suf, 0);
+        if (Eo < F) Eo = F;
+        size_t from = F < oc ? (size_t)(oi->lines[F].text - old) : oldLen;
+        size_t to = Eo < oc ? (size_t)((oi->lines[Eo].text - old) + delta) : len;
+
+        if (copyLines(a, &idx, oi->lines, F, old, text, 0) != 0 ||
+            indexLines(a, &idx, text + from, to - from) != 0) goto nomem;
+        int En = idx.count;
+        lineShift = En - Eo;
+        if (copyLines(a, &idx, oi->lines + Eo, oc - Eo, old, text, delta) != 0) goto nomem;
+        lineTok = arenaAlloc(a, (size_t)(idx.count + 1) * sizeof(int));
+        inFence = arenaAlloc(a, (size_t)idx.count + 1);
+        if (!lineTok || !inFence) goto nomem;
+
+        // tokens of the unchanged lines before, the edited lines lexed afresh...
+        int keep = doc->lineTok[F];
+        ts.toks = arenaAlloc(a, (size_t)(doc->ts.count + 64) * sizeof(Token));
+        if (!ts.toks) goto nomem;
+        ts.cap = doc->ts.count + 64;
+        if (keep) memcpy(ts.toks, doc->ts.toks, (size_t)keep * sizeof(Token));
+        ts.count = keep;
+        memcpy(lineTok, doc->lineTok, (size_t)F * sizeof(int));
+        memcpy(inFence, doc->inFence, (size_t)F);
+        fence = doc->inFence[F];
+        if (lexLines(idx.lines, F, En, &ts, &fence, lineTok, inFence) != 0) goto nomem;
+        // ...and on until a line starts in the same fence state as before
+        R = En;
+        while (R < idx.count && fence != doc->inFence[R - lineShift]) {
+            if (lexLines(idx.lines, R, R + 1, &ts, &fence, lineTok, inFence) != 0) goto nomem;
+            R++;
+        }
+        // then the old tokens of the rest, moved down by the lines added
+        Ro = R - lineShift;
+        int rest = doc->ts.count - doc->lineTok[Ro];
+        int tokShift = ts.count - doc->lineTok[Ro];
+        if (ts.count + rest > ts.cap) {
+            Token *grown = arenaGrow(a, ts.toks, (size_t)ts.cap * sizeof(Token), (size_t)(ts.count + rest) * sizeof(Token));
+            if (!grown) goto nomem;
+            ts.toks = grown;
+            ts.cap = ts.count + rest;
+        }
+        for (int t = 0; t < rest; t++) {
+            ts.toks[ts.count] = doc->ts.toks[doc->lineTok[Ro] + t];
+            ts.toks[ts.count++].line += lineShift;
+        }
+        for (int i = R; i < idx.count; i++) {
+            lineTok[i] = doc->lineTok[i - lineShift] + tokShift;
+            inFence[i] = doc->inFence[i - lineShift];
+        }
+        if (R < idx.count) fence = doc->inFence[oc];
+    }
+    lineTok[idx.count] = ts.count;
+    inFence[idx.count] = (unsigned char)fence;
+    if (c.stats) c.stats->lex_time = lap(&tick);
+
+    // Renumber from the first citation after the edit, unless a full entry
+    // changed (or -d is on, whose numbering depends on every citation)
+    int resume = lexed && collected && !doc->opts.relaxed_duplicates;
+    if (resume) {
+        for (int t = doc->lineTok[F]; resume && t < doc->lineTok[Ro]; t++) {
+            if (doc->ts.toks[t].type == TOK_DEF) resume = 0;
+        }
+        for (int t = lineTok[F]; resume && t < lineTok[R]; t++) {
+            if (ts.toks[t].type == TOK_DEF) resume = 0;
+        }
+    }
+    if (!resume) {
+        collectDocument(&c, &idx, &ts);
+    } else {
+        const Collector *oc = &doc->c;
+        // the same full entries, those after the edit moved down
+        c.fullCount = c.fullCap = oc->fullCount;
+        c.fullEntries = arenaCopy(a, oc->fullEntries, (size_t)oc->fullCount * sizeof(FullEntry));
+        c.labels = oc->labels;
+        c.labels.arena = a;
+        c.labels.slots = arenaCopy(a, oc->labels.slots, (size_t)oc->labels.cap * sizeof(LabelSlot));
+        if ((oc->fullCount && !c.fullEntries) || (oc->labels.cap && !c.labels.slots)) goto nomem;
+        for (int k = 0; k < c.fullCount; k++) {
+            FullEntry *e = &c.fullEntries[k];
+            int moved = e->lineIdx >= Ro;
+            e->label = text + ((e->label - old) + (moved ? delta : 0));
+            if (moved) e->lineIdx += lineShift;
+        }
+
+        // keep the citations before the edit and the numbers they handed out
+        int p = 0;
+        while (p < oc->cites.count && oc->cites.line[p] < F) p++;
+        c.cites = oc->cites;
+        c.cites.count = p;
+        if (growCites(a, &c.cites, p ? p : 16) != 0) goto nomem;
+        int maxNum = 0;
+        for (int k = 0; k < p; k++) {
+            if (c.cites.newNum[k] > maxNum) maxNum = c.cites.newNum[k];
+        }
+        for (int k = 0; k < c.fullCount; k++) {
+            if (c.fullEntries[k].newNum > maxNum) c.fullEntries[k].newNum = 0;
+        }
+        for (int k = 0; k < c.labels.cap; k++) {
+            if (c.labels.slots[k].lastLine >= F) c.labels.slots[k].lastLine = -1;
+        }
+        c.nextNum = maxNum + 1;
+        if (oc->firstChange >= 0 && oc->firstChange < p) {
+            c.firstChange = oc->firstChange;
+            c.changed = true;
+        }
+
+        // the quote state at the start of line F: the last mark of the lines before
+        QuoteState quotes = { F, 0, MARK_NONE, MARK_NONE, 0 };
+        for (int i = F - 1; i >= 0 && quotes.carried == MARK_NONE; i--) {
+            quotes.carried = backScanForQuote(idx.lines[i].text, 0, idx.lines[i].len);
+            quotes.backtracks++;
+        }
+        int failed = collectCites(&c, &idx, &ts, lineTok[F], &quotes, NULL);
+        if (c.stats) {
+            c.stats->in_text_time = lap(&tick);
+            c.stats->quote_backtracks = quotes.backtracks;
+        }
+        if (!failed) {
+            finishCollect(&c);
+            if (c.stats) c.stats->number_time = lap(&tick);
+        }
+    }
+
+    doc->idx = idx;
+    doc->ts = ts;
+    doc->lineTok = lineTok;
+    doc->inFence = inFence;
+    doc->lexed = 1;
+    if (result->status == CITEORDER_OK && !doc->opts.check) {
+        doc->c = c;
+        doc->collected = 1;
+        if (c.stats) tick = now();
+        if (!doc->opts.report || buildReport(&c, &idx, &ts) == 0) buildOutput(&c, &idx, &ts, text, len);
+        if (c.stats) c.stats->render_time = lap(&tick);
+    }
+    if (c.stats) countStats(c.stats, &c, &idx, &ts, len);
+    return result->status;
+
+nomem:
+    failErrno(&c, CITEORDER_ERR_NO_MEMORY, "malloc");
+    return result->status;
+}
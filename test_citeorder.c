@@ -2,9 +2,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
 
-FILE *junit;
-int failures = 0;
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <unistd.h>
+#include <pthread.h>
+#define HAVE_THREADS
+#endif
+
+// citeorder.c is linked in (built with CITEORDER_NO_MAIN), so each case runs the
+// command line in-process instead of spawning ./citeorder through a shell.
+// Build it with -DCITEORDER_CHUNK_MIN=16 too, so that "-j" splits even these
+// small documents into chunks on separate threads (see the chunked-* cases).
+int citeorder_cli(int argc, char **argv, FILE *out, FILE *err);
+
+typedef struct {
+    const char *test_name;
+    const char *flag;
+    const char *inputFile;
+    const char *expectedOutputFile;
+    const char *expectedStdoutFile;
+    const char *expectedStderrFile;
+} TestCase;
+
+// What a case did, reported once every case has run
+typedef struct {
+    bool pass;
+    const char *error_message;
+    double seconds;
+    FILE *log;      // the case's console output, printed in order afterwards
+} TestResult;
 
 // Helper to write a test file
 // ---------------------------
@@ -42,27 +69,31 @@ int run_citeorder(const char *flag,
 		          const char *stdoutFile,
 		          const char *stderrFile)
 {
-    char cmd[512];
-#ifdef _WIN32
-    if (flag && flag[0] != '\0')
-        snprintf(cmd, sizeof(cmd),
-	             "citeorder.exe %s \"%s\" 1>\"%s\" 2>\"%s\"",
-	             flag, inputFile, stdoutFile, stderrFile);
-    else
-        snprintf(cmd, sizeof(cmd),
-	             "citeorder.exe \"%s\" 1>\"%s\" 2>\"%s\"",
-	             inputFile, stdoutFile, stderrFile);
-#else
-    if (flag && flag[0] != '\0')
-        snprintf(cmd, sizeof(cmd),
-	             "./citeorder %s \"%s\" 1>\"%s\" 2>\"%s\"",
-	             flag, inputFile, stdoutFile, stderrFile);
-    else
-        snprintf(cmd, sizeof(cmd),
-	             "./citeorder \"%s\" 1>\"%s\" 2>\"%s\"",
-	             inputFile, stdoutFile, stderrFile);
-#endif
-    return system(cmd);
+    // argv as the shell would split it: "citeorder [flags...] input"
+    char flags[128] = "";
+    char *argv[16];
+    int argc = 0;
+    argv[argc++] = "citeorder";
+    if (flag) {
+        snprintf(flags, sizeof(flags), "%s", flag);
+        // split in place (strtok is not safe to call from several threads)
+        for (char *p = flags; *p && argc < 14; ) {
+            while (*p == ' ') *p++ = '\0';
+            if (!*p) break;
+            argv[argc++] = p;
+            while (*p && *p != ' ') p++;
+        }
+    }
+    argv[argc++] = (char *)inputFile;
+    argv[argc] = NULL;
+
+    FILE *out = fopen(stdoutFile, "wb");
+    FILE *err = fopen(stderrFile, "wb");
+    int ret = -1;
+    if (out && err) ret = citeorder_cli(argc, argv, out, err);
+    if (out) fclose(out);
+    if (err) fclose(err);
+    return ret;
 }
 
 // Normalize line endings (strip \r)
@@ -80,7 +111,7 @@ void normalize_line_endings(char *s) {
 
 // Check if two files match
 // ------------------------
-bool files_match(const char *actual_file, const char *expected_file, bool ignore_path) {
+bool files_match(const char *actual_file, const char *expected_file, bool ignore_path, FILE *log) {
     char *actual = read_file(actual_file);
     char *expected = read_file(expected_file);
 
@@ -143,8 +174,8 @@ bool files_match(const char *actual_file, const char *expected_file, bool ignore
     }
     
     if (!match) {
-        printf("DEBUG expected: \n[%s]\n", expected);
-        printf("DEBUG actual:   \n[%s]\n", actual);
+        fprintf(log, "DEBUG expected: \n[%s]\n", expected);
+        fprintf(log, "DEBUG actual:   \n[%s]\n", actual);
 
         // for (size_t i = 0; i < alen; i++) printf("%02X ", (unsigned char)actual[i]);
         // printf("\n");
@@ -157,17 +188,32 @@ bool files_match(const char *actual_file, const char *expected_file, bool ignore
     return match;
 }
 
+// Wall-clock seconds, for the per-case durations in results.xml
+// -------------------------------------------------------------
+double now(void) {
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 // Run a single test case
 // ----------------------
-void run_test_case(const char *test_name,
-		           const char *flag,
-		           const char *inputFile,
-		           const char *expectedOutputFile,
-                   const char *expectedStdoutFile,
-		           const char *expectedStderrFile)
+void run_test_case(const TestCase *tc, TestResult *result)
 {
+    const char *test_name          = tc->test_name;
+    const char *flag               = tc->flag;
+    const char *inputFile          = tc->inputFile;
+    const char *expectedOutputFile = tc->expectedOutputFile;
+    const char *expectedStdoutFile = tc->expectedStdoutFile;
+    const char *expectedStderrFile = tc->expectedStderrFile;
+    FILE *log = result->log;
+    double start = now();
 
-    printf("\nRunning test: %s\n", test_name);
+    fprintf(log, "\nRunning test: %s\n", test_name);
 
     char outFile[128], outStd[128], outErr[128];
     const char *outDir = "tests/output/";
@@ -175,254 +221,512 @@ void run_test_case(const char *test_name,
     snprintf(outStd,  sizeof(outStd),  "%s%s_stdout.txt", outDir, test_name);
     snprintf(outErr,  sizeof(outErr),  "%s%s_stderr.txt", outDir, test_name);
 
-    int ret = run_citeorder(flag, inputFile, outStd, outErr);
-    if (ret != 0) {
-        printf("citeorder returned non-zero exit code: %d\n", ret);
+    // an in-place case rewrites a scratch copy of its input, checked like any other output
+    const char *runFile = inputFile;
+    if (flag && strstr(flag, "--in-place")) {
+        char *content = read_file(inputFile);
+        if (content) {
+            write_file(outFile, content);
+            free(content);
+        }
+        runFile = outFile;
     }
-    
+
+    // a cached case starts from no cache, then runs again to hit the one the
+    // first run left, and both must report the same
+    int runs = 1;
+    if (flag && strstr(flag, "--cache=")) {
+        char cachePath[128], lockPath[160];
+        snprintf(cachePath, sizeof(cachePath), "%s", strstr(flag, "--cache=") + 8);
+        cachePath[strcspn(cachePath, " ")] = '\0';
+        snprintf(lockPath, sizeof(lockPath), "%s.lock", cachePath);
+        remove(cachePath);
+        remove(lockPath);
+        runs = 2;
+    }
+
     int test_case = -1;
     bool pass = true;
-    char *error_message;
-    if (expectedOutputFile && expectedStdoutFile) {
-        if (!files_match(outFile, expectedOutputFile, 0)) {
-	        error_message = "FAIL: output file mismatch";
-	        printf("%s\n", error_message);
-            pass = false;
-	    }
-	    if (!files_match(outStd, expectedStdoutFile, 1)) {
-	        error_message = "FAIL: stdout file mismatch";
-	        printf("%s\n", error_message);
+    const char *error_message = NULL;
+    for (int run = 0; run < runs && pass; run++) {
+        if (run > 0) fprintf(log, "Running again, from the cache\n");
+        int ret = run_citeorder(flag, runFile, outStd, outErr);
+        if (ret != 0) {
+            fprintf(log, "citeorder returned non-zero exit code: %d\n", ret);
+        }
+        
+        if (expectedOutputFile && expectedStdoutFile) {
+            if (!files_match(outFile, expectedOutputFile, 0, log)) {
+    	        error_message = "FAIL: output file mismatch";
+    	        fprintf(log, "%s\n", error_message);
+                pass = false;
+    	    }
+    	    if (!files_match(outStd, expectedStdoutFile, 1, log)) {
+    	        error_message = "FAIL: stdout file mismatch";
+    	        fprintf(log, "%s\n", error_message);
+                pass = false;
+    	    }
+    	    test_case = 0;
+        }  
+        else if (expectedStdoutFile && !files_match(outStd, expectedStdoutFile, 0, log)) {
+            error_message = "FAIL: stdout mismatch";
+    	    fprintf(log, "%s\n", error_message);
             pass = false;
-	    }
-	    test_case = 0;
-    }  
-    else if (expectedStdoutFile && !files_match(outStd, expectedStdoutFile, 0)) {
-        error_message = "FAIL: stdout mismatch";
-	    printf("%s\n", error_message);
-        pass = false;
-	    test_case = 1;
-    }
-    else if (expectedStderrFile && !files_match(outErr, expectedStderrFile, 0)) {
-        error_message = "FAIL: stderr mismatch";
-	    printf("%s\n", error_message);
-	    pass = false;
-	    test_case = 2;
+    	    test_case = 1;
+        }
+        else if (expectedStderrFile && !files_match(outErr, expectedStderrFile, 0, log)) {
+            error_message = "FAIL: stderr mismatch";
+    	    fprintf(log, "%s\n", error_message);
+    	    pass = false;
+    	    test_case = 2;
+        }
     }
 
     if (pass) {
-        printf("PASS\n");
-	    fprintf(junit, "  <testcase classname=\"citeorder\" name=\"%s\"/>\n", test_name);
+        fprintf(log, "PASS\n");
     } else {
-        printf("Input file: %s\n", inputFile);
-	    if (test_case == 0) { printf("Check %s, %s for details\n", outFile, outStd); }
-	    if (test_case == 1) { printf("Check %s for details\n", outStd); }
-	    if (test_case == 2) { printf("Check %s for details\n", outErr); }
-	    fprintf(junit, "  <testcase classname=\"citeorder\" name=\"%s\">\n", test_name);
-    	fprintf(junit, "    <failure message=\"%s\">TBA</failure>\n", error_message);
-	    fprintf(junit, "  </testcase>\n");
-	    failures++;
+        fprintf(log, "Input file: %s\n", inputFile);
+	    if (test_case == 0) { fprintf(log, "Check %s, %s for details\n", outFile, outStd); }
+	    if (test_case == 1) { fprintf(log, "Check %s for details\n", outStd); }
+	    if (test_case == 2) { fprintf(log, "Check %s for details\n", outErr); }
     }
+    result->pass = pass;
+    result->error_message = error_message;
+    result->seconds = now() - start;
 }
 
-// Example test cases
-int main() {
-    int total_tests = 22;
-    junit = fopen("results.xml", "w");
-    if (!junit) return 1;
-    long headerPos = ftell(junit);
-    fprintf(junit, "<testsuite name=\"citeorder\" tests=\"%d\" failures=\"%s\">\n",
-	        total_tests, "F");
+// Cases are independent (each writes only its own output files), so they
+// are handed out one at a time to a pool of threads
+typedef struct {
+    const TestCase *cases;
+    TestResult *results;
+    int count;
+    int next;
+#ifdef HAVE_THREADS
+    pthread_mutex_t lock;
+#endif
+} TestPool;
+
+static void *run_worker(void *arg) {
+    TestPool *pool = arg;
+    for (;;) {
+#ifdef HAVE_THREADS
+        pthread_mutex_lock(&pool->lock);
+#endif
+        int idx = pool->next < pool->count ? pool->next++ : -1;
+#ifdef HAVE_THREADS
+        pthread_mutex_unlock(&pool->lock);
+#endif
+        if (idx < 0) break;
+        run_test_case(&pool->cases[idx], &pool->results[idx]);
+    }
+    return NULL;
+}
 
+static void run_all(TestPool *pool, int nthreads) {
+#ifdef HAVE_THREADS
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_t threads[64];
+    if (nthreads > 64) nthreads = 64;
+    int started = 0;
+    while (started < nthreads - 1 &&
+           pthread_create(&threads[started], NULL, run_worker, pool) == 0) {
+        started++;
+    }
+    run_worker(pool);
+    for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&pool->lock);
+#else
+    (void)nthreads;
+    run_worker(pool);
+#endif
+}
+
+// Escape text for an XML attribute
+static void xml_attr(FILE *f, const char *s) {
+    for (; *s; s++) {
+        if (*s == '"') fputs("&quot;", f);
+        else if (*s == '&') fputs("&amp;", f);
+        else if (*s == '<') fputs("&lt;", f);
+        else fputc(*s, f);
+    }
+}
+
+static const TestCase cases[] = {
     // 1. No change required test
-    run_test_case("no-change",
+    { "no-change",
 		          NULL,					                       // flag
         	      "tests/no-change.md",                        // input file
         	      NULL,				                           // expected output file
                   "tests/expected/no-change_stdout.txt",       // expected stdout
         	      NULL                                         // expected stderr
-    );
+    },
     // 2. Stacked renumbering test
-    run_test_case("stacked",
+    { "stacked",
 		          NULL,					                       // flag
         	      "tests/stacked.md", 	                       // input file
         	      "tests/expected/stacked-fixed.md",           // expected output file
                   "tests/expected/stacked_stdout.txt",	       // expected stdout
         	      NULL                                         // expected stderr
-    );
+    },
     // 3. Missing quote test
-    run_test_case("missing-quote",
+    { "missing-quote",
 		          NULL,					                       // flag
                   "tests/missing-quote.md",                    // input file
                   NULL,                                        // expected output file
                   NULL,                                        // expected stdout
                   "tests/expected/missing-quote_stderr.txt"    // expected stderr
-    );
+    },
     // 4. Missing full-entry test
-    run_test_case("missing-full",
+    { "missing-full",
 		          NULL,					                       // flag
                   "tests/missing-full.md",                     // input file
                   NULL,                                        // expected output file
                   NULL,                                        // expected stdout
                   "tests/expected/missing-full_stderr.txt"     // expected stderr
-    );
+    },
     // 5. Unused quote test
-    run_test_case("unused-quote",
+    { "unused-quote",
 		          NULL,					                       // flag
                   "tests/unused-quote.md",                     // input file
                   "tests/expected/unused-quote-fixed.md",      // expected output file
                   "tests/expected/unused-quote_stdout.txt",    // expected stdout
                   NULL                                         // expected stderr
-    );
+    },
     // 6. Full-entry test
-    run_test_case("full-entry",
+    { "full-entry",
 		          NULL,					                       // flag
                   "tests/full-entry.md",                       // input file
                   "tests/expected/full-entry-fixed.md",        // expected output file
                   "tests/expected/full-entry_stdout.txt",      // expected stdout
                   NULL                                         // expected stderr
-    );
+    },
     // 7. Multiple punctuation test
-    run_test_case("multiple-punc",
+    { "multiple-punc",
 		          NULL,					                       // flag
                   "tests/multiple-punc.md",                    // input file
                   NULL,				                           // expected output file
                   NULL,					                       // expected stdout
                   "tests/expected/multiple-punc_stderr.txt"    // expected stderr
-    );
+    },
     // 8. Separated stack test
-    run_test_case("separated-stack",
+    { "separated-stack",
 		          NULL,					                       // flag
                   "tests/separated-stack.md",                  // input file
                   NULL,				                           // expected output file
                   NULL,					                       // expected stdout
                   "tests/expected/separated-stack_stderr.txt"  // expected stderr
-    );
+    },
     // 9. Multiline quote test
-    run_test_case("multiline-quote",
+    { "multiline-quote",
 		          NULL,					                       // flag
                   "tests/multiline-quote.md",                  // input file
                   "tests/expected/multiline-quote-fixed.md",   // expected output file
                   "tests/expected/multiline-quote_stdout.txt", // expected stdout
                   NULL                                         // expected stderr
-    );
+    },
     // 10. Inline-code test
-    run_test_case("inline-code",
+    { "inline-code",
 		          NULL,					                       // flag
                   "tests/inline-code.md",                      // input file
                   "tests/expected/inline-code-fixed.md",       // expected output file
                   "tests/expected/inline-code_stdout.txt",     // expected stdout
                   NULL                                         // expected stderr
-    );
+    },
     // 11. Fenced code example
-    run_test_case("fenced-code",
+    { "fenced-code",
 		          NULL,					                       // flag
                   "tests/fenced-code.md",                      // input file
                   "tests/expected/fenced-code-fixed.md",       // expected output file
                   "tests/expected/fenced-code_stdout.txt",     // expected stdout
                   NULL                                         // expected stderr
-    );
+    },
     // 12. Relaxed quotes example
-    run_test_case("relaxed-quotes",
+    { "relaxed-quotes",
 		          "-q",					                       // flag
                   "tests/relaxed-quotes.md",                   // input file
                   "tests/expected/relaxed-quotes-fixed.md",    // expected output file
                   "tests/expected/relaxed-quotes_stdout.txt",  // expected stdout
                   NULL                                         // expected stderr
-    );
+    },
     // 13. String citation example
-    run_test_case("string-cite",
+    { "string-cite",
 		          NULL,				                           // flag
                   "tests/string-cite.md",                      // input file
                   "tests/expected/string-cite-fixed.md",       // expected output file
                   "tests/expected/string-cite_stdout.txt",     // expected stdout
                   NULL                                         // expected stderr
-    );
+    },
     // 14. Spaced full-entry test
-    run_test_case("spaced-fullentry",
+    { "spaced-fullentry",
 		          NULL,					                       // flag
                   "tests/spaced-fullentry.md",                 // input file
                   NULL,				                           // expected output file
                   NULL,					                       // expected stdout
                   "tests/expected/spaced-fullentry_stderr.txt" // expected stderr
-    );
+    },
     // 15. Spaced in-text test
-    run_test_case("spaced-intext",
+    { "spaced-intext",
 		          NULL,					                       // flag
                   "tests/spaced-intext.md",                    // input file
                   NULL,				                           // expected output file
                   NULL,					                       // expected stdout
                   "tests/expected/spaced-intext_stderr.txt"    // expected stderr
-    );
+    },
     // 16. Missing full-entry label test
-    run_test_case("missing-label-full",
+    { "missing-label-full",
 		          NULL,					                            // flag
                   "tests/missing-label-full.md",                    // input file
                   NULL,				                                // expected output file
                   NULL,					                            // expected stdout
                   "tests/expected/missing-label-full_stderr.txt"    // expected stderr
-    );
+    },
     // 17. Missing in-text label test
-    run_test_case("missing-label-intext",
+    { "missing-label-intext",
 		          NULL,					                            // flag
                   "tests/missing-label-intext.md",                  // input file
                   NULL,				                                // expected output file
                   NULL,					                            // expected stdout
                   "tests/expected/missing-label-intext_stderr.txt"  // expected stderr
-    );
+    },
     // 18. Relaxed duplicates
-    run_test_case("relaxed-duplicates",
+    { "relaxed-duplicates",
 		          "-d",					                            // flag
                   "tests/relaxed-duplicates.md",                    // input file
                   "tests/expected/relaxed-duplicates-fixed.md",     // expected output file
                   "tests/expected/relaxed-duplicates_stdout.txt",   // expected stdout
                   NULL                                              // expected stderr
-    );
+    },
     // 19. Multiple duplicates
-    run_test_case("multiple-duplicates",
+    { "multiple-duplicates",
 		          "-d",					                            // flag
                   "tests/multiple-duplicates.md",                   // input file
                   NULL,				                                // expected output file
                   NULL,					                            // expected stdout
                   "tests/expected/multiple-duplicates_stderr.txt"   // expected stderr
-    );
+    },
     // 20. Unequal duplicates
-    run_test_case("unequal-duplicates",
+    { "unequal-duplicates",
 		          "-d",					                            // flag
                   "tests/unequal-duplicates.md",                    // input file
                   NULL,				                                // expected output file
                   NULL,					                            // expected stdout
                   "tests/expected/unequal-duplicates_stderr.txt"    // expected stderr
-    );
+    },
     // 21. Code block
-    run_test_case("code-block",
+    { "code-block",
 		          NULL,					                       // flag
                   "tests/code-block.md",                       // input file
                   "tests/expected/code-block-fixed.md",        // expected output file
                   "tests/expected/code-block_stdout.txt",      // expected stdout
                   NULL                                         // expected stderr
-    );
+    },
     // 22. Real example
-    run_test_case("real-example",
+    { "real-example",
 		          NULL,					                       // flag
                   "tests/real-example.md",                     // input file
                   "tests/expected/real-example-fixed.md",      // expected output file
                   "tests/expected/real-example_stdout.txt",    // expected stdout
                   NULL                                         // expected stderr
-    );
+    },
+    // 23. Line longer than 1024 bytes
+    { "long-line",
+		          NULL,					                       // flag
+                  "tests/long-line.md",                        // input file
+                  "tests/expected/long-line-fixed.md",         // expected output file
+                  "tests/expected/long-line_stdout.txt",       // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 24. Non-definition line containing "]:" is kept
+    { "not-definition",
+		          NULL,					                       // flag
+                  "tests/not-definition.md",                   // input file
+                  "tests/expected/not-definition-fixed.md",    // expected output file
+                  "tests/expected/not-definition_stdout.txt",  // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 25. Directory of files processed in parallel, reported in order
+    { "batch",
+		          "-j 2",				                       // flag
+                  "tests/batch",                               // input directory
+                  NULL,                                        // expected output file
+                  "tests/expected/batch_stdout.txt",           // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 26. Streaming mode, full entries before their in-text citations
+    { "stream",
+		          "-s",					                       // flag
+                  "tests/stream.md",                           // input file
+                  "tests/expected/stream-fixed.md",            // expected output file
+                  "tests/expected/stream_stdout.txt",          // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 27. Check mode reports the first label out of order and writes nothing
+    { "check",
+		          "--check",			                       // flag
+                  "tests/check.md",                            // input file
+                  NULL,                                        // expected output file
+                  "tests/expected/check_stdout.txt",           // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 28. Diff mode prints the renumbered lines as a unified diff and writes nothing
+    { "diff",
+		          "--diff",			                       // flag
+                  "tests/diff.md",                             // input file
+                  NULL,                                        // expected output file
+                  "tests/expected/diff_stdout.txt",            // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 29. In-place mode replaces the input file itself
+    { "in-place",
+		          "--in-place",			                       // flag
+                  "tests/in-place.md",                         // input file
+                  "tests/expected/in-place-fixed.md",          // expected output file
+                  "tests/expected/in-place_stdout.txt",        // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 30. A stack and definition blocks long enough for the radix sorts
+    { "long-stack",
+		          NULL,					                       // flag
+                  "tests/long-stack.md",                       // input file
+                  "tests/expected/long-stack-fixed.md",        // expected output file
+                  "tests/expected/long-stack_stdout.txt",      // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 31. Stats go to stderr and leave the output alone (their timings vary, so stderr is not compared)
+    { "stats",
+		          "--stats=json",		                       // flag
+                  "tests/stats.md",                            // input file
+                  "tests/expected/stats-fixed.md",             // expected output file
+                  "tests/expected/stats_stdout.txt",           // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 32. A cached run reports the same as an uncached one (run twice: a miss, then a hit)
+    { "cache",
+		          "--cache=tests/cache.citeorder-cache",       // flag
+                  "tests/cache.md",                            // input file
+                  "tests/expected/cache-fixed.md",             // expected output file
+                  "tests/expected/cache_stdout.txt",           // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 33. Single-backtick code spans hide footnotes too, and a run closes only at one of the same length
+    { "single-backtick",
+		          NULL,					                       // flag
+                  "tests/single-backtick.md",                  // input file
+                  "tests/expected/single-backtick-fixed.md",   // expected output file
+                  "tests/expected/single-backtick_stdout.txt", // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 34. The JSON report maps each label to its new number, in place of the usual message
+    { "report",
+		          "--report=json",		                       // flag
+                  "tests/report.md",                           // input file
+                  "tests/expected/report-fixed.md",            // expected output file
+                  "tests/expected/report_stdout.txt",          // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 35. Serve mode renumbers a document kept open across edits, answering with byte ranges
+    { "serve",
+		          "--serve",			                       // flag
+                  "tests/serve.jsonl",                         // input file
+                  NULL,                                        // expected output file
+                  "tests/expected/serve_stdout.txt",           // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 36. A single file on 4 threads, with chunk boundaries inside fenced code, matches the sequential output
+    { "chunked-fences",
+		          "-j 4",				                       // flag
+                  "tests/chunked-fences.md",                   // input file
+                  "tests/expected/chunked-fences-fixed.md",    // expected output file
+                  "tests/expected/chunked-fences_stdout.txt",  // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 37. The same with chunk boundaries inside multi-line quotes
+    { "chunked-quotes",
+		          "-j 4",				                       // flag
+                  "tests/chunked-quotes.md",                   // input file
+                  "tests/expected/chunked-quotes-fixed.md",    // expected output file
+                  "tests/expected/chunked-quotes_stdout.txt",  // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 38. The same with chunk boundaries inside a block of full entries
+    { "chunked-defs",
+		          "-j 4",				                       // flag
+                  "tests/chunked-defs.md",                     // input file
+                  "tests/expected/chunked-defs-fixed.md",      // expected output file
+                  "tests/expected/chunked-defs_stdout.txt",    // expected stdout
+                  NULL                                         // expected stderr
+    },
+    // 39. Check mode stops at the first label out of order, before reading a later duplicate full entry
+    { "check-early",
+		          "--check",			                       // flag
+                  "tests/check-early.md",                      // input file
+                  NULL,                                        // expected output file
+                  "tests/expected/check-early_stdout.txt",     // expected stdout
+                  NULL                                         // expected stderr
+    },
+
+};
+
+// Example test cases
+// Usage: test_citeorder [-j N]   (N threads, default one per CPU)
+int main(int argc, char **argv) {
+    int total_tests = (int)(sizeof(cases) / sizeof(cases[0]));
+    int failures = 0;
+    int nthreads = 1;
+#ifdef HAVE_THREADS
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 1) nthreads = (int)ncpu;
+#endif
+    if (argc == 3 && strcmp(argv[1], "-j") == 0 && atoi(argv[2]) > 0) nthreads = atoi(argv[2]);
 
+    TestResult *results = calloc((size_t)total_tests, sizeof(TestResult));
+    if (!results) return 1;
+    for (int i = 0; i < total_tests; i++) {
+        results[i].log = tmpfile();
+        if (!results[i].log) { perror("tmpfile"); return 1; }
+    }
+
+    double start = now();
+    TestPool pool = { .cases = cases, .results = results, .count = total_tests };
+    run_all(&pool, nthreads);
+    double elapsed = now() - start;
+
+    FILE *junit = fopen("results.xml", "w");
+    if (!junit) return 1;
+    for (int i = 0; i < total_tests; i++) {
+        if (!results[i].pass) failures++;
+    }
+    fprintf(junit, "<testsuite name=\"citeorder\" tests=\"%d\" failures=\"%d\" time=\"%.6f\">\n",
+	        total_tests, failures, elapsed);
+
+    // Report in case order, whichever finished first
+    for (int i = 0; i < total_tests; i++) {
+        TestResult *r = &results[i];
+        char chunk[4096];
+        size_t n;
+        rewind(r->log);
+        while ((n = fread(chunk, 1, sizeof(chunk), r->log)) > 0) fwrite(chunk, 1, n, stdout);
+        fclose(r->log);
+
+        fprintf(junit, "  <testcase classname=\"citeorder\" name=\"");
+        xml_attr(junit, cases[i].test_name);
+        fprintf(junit, "\" time=\"%.6f\"", r->seconds);
+        if (r->pass) {
+	        fprintf(junit, "/>\n");
+        } else {
+	        fprintf(junit, ">\n");
+    	    fprintf(junit, "    <failure message=\"%s\">TBA</failure>\n", r->error_message);
+	        fprintf(junit, "  </testcase>\n");
+        }
+    }
     fprintf(junit, "</testsuite>\n");
-    
-    // --- go back and patch failures ---
-    fseek(junit, headerPos, SEEK_SET);
-    fprintf(junit, "<testsuite name=\"citeorder\" tests=\"%d\" failures=\"%d\">",
-	        total_tests, failures);
-    
     fclose(junit);
-    
+    free(results);
+
     printf("\nTotal tests: %d | Passed: %d | Failed: %d\n",
            total_tests, total_tests-failures, failures);
     
     if (failures > 0) return 1;
     else return 0;
 }
-